@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+"""Collect the HLS estimates of a `make dse` sweep into one CSV table.
+
+Every geometry directory (dse/<rows>x<cols>/work.out) holds one Vitis HLS
+csynth report per task. The kernel is a dataflow of LoadAct, WGT_CHANNELS
+LoadWgt instances, Compute, Epilogue, StoreResult and StoreQ8, plus K_SPLIT
+ComputeSlice instances and ReduceK in a K-split build, so its resources are
+the sum of the task reports (LoadWgt counted once per channel, ComputeSlice
+once per slice) and its latency is that of the slowest task. The Profiler
+(counters with PROFILE=1) adds its resources when its report exists but,
+only listening to the others, not its latency. Latencies are the HLS
+loop_tripcount estimates, i.e. one M_DIM x K_DIM x N_DIM call.
+
+usage: dse_report.py [--channels N] [--k-split N] DSE_DIR CONFIG...
+"""
+
+import argparse
+import glob
+import os
+import sys
+import xml.etree.ElementTree as ET
+
+# Alveo U55C (xcu55c) totals
+DEVICE = {"LUT": 1303680, "FF": 2607360, "BRAM_18K": 4032, "URAM": 960, "DSP": 9024}
+TASKS = ("LoadAct", "LoadWgt", "Compute", "Epilogue", "StoreResult", "StoreQ8")
+KSPLIT_TASKS = ("ComputeSlice", "ReduceK")  # SA_K_SPLIT > 1 only
+OPTIONAL_TASKS = ("Profiler",)
+
+
+def parse_csynth(path):
+    root = ET.parse(path).getroot()
+
+    def num(tag):
+        node = root.find(".//" + tag)
+        try:
+            return float(node.text)
+        except (AttributeError, TypeError, ValueError):
+            return None
+
+    return {
+        "top": root.findtext(".//UserAssignments/TopModelName", ""),
+        "clock": num("SummaryOfTimingAnalysis/EstimatedClockPeriod"),
+        "latency": num("SummaryOfOverallLatency/Worst-caseLatency"),
+        "res": {r: num("AreaEstimates/Resources/" + r) or 0 for r in DEVICE},
+    }
+
+
+def collect(work_dir, channels, k_split):
+    required = TASKS + (KSPLIT_TASKS if k_split > 1 else ())
+    reports = {}
+    for path in glob.glob(os.path.join(work_dir, "**", "*_csynth.xml"), recursive=True):
+        rpt = parse_csynth(path)
+        if rpt["top"] in TASKS + KSPLIT_TASKS + OPTIONAL_TASKS:
+            reports[rpt["top"]] = rpt
+    missing = [t for t in required if t not in reports]
+    if missing:
+        return None, missing
+
+    copies_of = {"LoadWgt": channels, "ComputeSlice": k_split}
+    total = dict.fromkeys(DEVICE, 0)
+    for task, rpt in reports.items():
+        copies = copies_of.get(task, 1)
+        for r in DEVICE:
+            total[r] += copies * rpt["res"][r]
+    clocks = [r["clock"] for r in reports.values() if r["clock"]]
+    latencies = [r["latency"] for t, r in reports.items() if r["latency"] and t not in OPTIONAL_TASKS]
+    return {
+        "clock": max(clocks) if clocks else None,
+        "latency": max(latencies) if latencies else None,
+        "res": total,
+    }, []
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--channels", type=int, default=8, help="SA_WGT_CHANNELS of the sweep")
+    ap.add_argument("--k-split", type=int, default=1, help="SA_K_SPLIT of the sweep")
+    ap.add_argument("dse_dir")
+    ap.add_argument("configs", nargs="+", help="geometries, ROWSxCOLS")
+    args = ap.parse_args()
+
+    cols = ["config", "pe_rows", "pe_cols", "est_clock_ns", "latency_cycles",
+            "latency_ms", "peak_gops"]
+    for r in DEVICE:
+        cols += [r.lower(), r.lower() + "_pct"]
+    print(",".join(cols))
+
+    failed = False
+    for cfg in args.configs:
+        rows, pe_cols = (int(x) for x in cfg.split("x"))
+        est, missing = collect(os.path.join(args.dse_dir, cfg, "work.out"), args.channels, args.k_split)
+        if est is None:
+            print("%s: no csynth report for %s" % (cfg, ", ".join(missing)), file=sys.stderr)
+            failed = True
+            continue
+        clock, latency = est["clock"], est["latency"]
+        row = [cfg, rows, pe_cols,
+               "%.3f" % clock if clock else "",
+               "%d" % latency if latency else "",
+               "%.3f" % (latency * clock * 1e-6) if clock and latency else "",
+               # one MAC (2 ops) per PE per cycle
+               "%.1f" % (2 * rows * pe_cols / clock) if clock else ""]
+        for r, avail in DEVICE.items():
+            row += ["%d" % est["res"][r], "%.1f" % (100.0 * est["res"][r] / avail)]
+        print(",".join(str(x) for x in row))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
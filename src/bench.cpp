@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+
+#include "bench.h"
+
+std::vector<BenchShape> parse_shapes(const std::string& list) {
+    std::vector<BenchShape> shapes;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        BenchShape s;
+        char x1 = 0, x2 = 0;
+        std::stringstream is(item);
+        if (!(is >> s.M >> x1 >> s.K >> x2 >> s.N) || x1 != 'x' || x2 != 'x' || !is.eof() ||
+            s.M < 1 || s.N < 1 || s.K < 1 || s.K > K_MAX) {
+            throw std::invalid_argument("bad shape '" + item + "' (MxKxN with 1 <= K <= K_MAX)");
+        }
+        shapes.push_back(s);
+    }
+    if (shapes.empty()) throw std::invalid_argument("no shapes to benchmark");
+    return shapes;
+}
+
+std::string kernel_config() {
+    std::ostringstream os;
+    os << PE_ROWS << "x" << PE_COLS << (SA_SYSTOLIC_MESH ? " mesh" : " broadcast")
+       << (SA_WGT_TILE_MAJOR ? " tile" : " row") << (wgt_fmt::exp_bits == 8 ? " mx" : " shift")
+       << (SA_WGT_SPARSE ? " sparse" : "") << (SA_ACT_INT4 ? " act4" : "") << (SA_DSP_PACK ? " pack" : "") << (K_SPLIT > 1 ? " ksplit" + std::to_string(K_SPLIT) : "")
+       << " ch" << WGT_CHANNELS;
+    return os.str();
+}
+
+BenchResult run_benchmark(
+    const std::string& bitstream,
+    Backend backend,
+    const BenchShape& shape,
+    const BenchOptions& opt
+) {
+    const int M = shape.M, K = shape.K, N = shape.N;
+    if (opt.iters < 1 || opt.warmup < 0) throw std::invalid_argument("run_benchmark: needs iters >= 1, warmup >= 0");
+
+    // Same synthetic data as the test driver; quantization is not timed
+    aligned_vector<int8_t> act((size_t)M * act_row_stride(K), 0);
+    for (int m = 0; m < M; m++) {
+        for (int k = 0; k < K; k++) {
+            act[(size_t)m * act_row_stride(K) + k] = (int8_t)(((m * 31 + k) % 17 - 8) * 15);
+        }
+    }
+    std::vector<float> wgt_fp32((size_t)K * N);
+    for (size_t i = 0; i < wgt_fp32.size(); i++) wgt_fp32[i] = ((int)(i % 19) - 9) / 9.0f;
+    aligned_vector<uint8_t> wgt_packed, scales;
+    pack_weights(wgt_fp32, wgt_packed, scales, K, N);
+    shard_array_t wgt_shards, scale_shards;
+    shard_weights(wgt_packed, scales, wgt_shards, scale_shards, K, N);
+    const WeightView view = view_shards(wgt_shards, scale_shards);
+    CpuWeights cpu_wgt;
+    if (backend == Backend::CPU) prepare_cpu_weights(wgt_packed, scales, cpu_wgt, K, N);
+    aligned_vector<int32_t> out((size_t)M * out_row_stride(N), 0);
+
+    // Wall time of one call; kernel_ns is the device time (CPU: the wall time)
+    auto call = [&](int64_t& kernel_ns) {
+        auto t0 = std::chrono::steady_clock::now();
+        auto since_t0 = [&] {
+            return (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+        };
+        if (backend == Backend::FPGA) {
+            kernel_ns = invoke_kernel(bitstream, act, view, out, M, K, N, CMD_RUN);
+            return since_t0();
+        }
+        cpu_gemm(act, cpu_wgt, out.data(), out_row_stride(N), M);
+        kernel_ns = since_t0();
+        return kernel_ns;
+    };
+
+    int64_t kernel_ns = 0;
+    for (int i = 0; i < opt.warmup; i++) call(kernel_ns);
+    std::vector<double> kernel_us, wall_us;
+    for (int i = 0; i < opt.iters; i++) {
+        const int64_t wall = call(kernel_ns);
+        kernel_us.push_back(kernel_ns / 1e3);
+        wall_us.push_back(wall / 1e3);
+    }
+
+    BenchResult r;
+    r.shape = shape;
+    r.iters = opt.iters;
+    auto mean = [](const std::vector<double>& v) { return std::accumulate(v.begin(), v.end(), 0.0) / v.size(); };
+    r.kernel_us_mean = mean(kernel_us);
+    r.wall_us_mean = mean(wall_us);
+    r.transfer_us_mean = std::max(0.0, r.wall_us_mean - r.kernel_us_mean);
+    std::sort(kernel_us.begin(), kernel_us.end());
+    r.kernel_us_min = kernel_us.front();
+    r.kernel_us_median = kernel_us[kernel_us.size() / 2];
+
+    const int64_t wgt_bytes = (int64_t)WGT_CHANNELS * (view.packed_bytes + view.scale_bytes);
+    const int passes = use_gemv(CMD_RUN, M, N) ? 1 : num_wgt_passes(M, K, N);
+    r.h2d_bytes = act_port_bytes(M, K) + wgt_bytes;
+    r.d2h_bytes = (int64_t)out.size() * sizeof(int32_t);
+    // K-streaming reads the activations once per N-group
+    const int act_passes = num_tiles(num_n_tiles(N), n_group_tiles(CMD_RUN, M, K, N));
+    r.hbm_bytes = act_passes * act_port_bytes(M, K) + passes * wgt_bytes + r.d2h_bytes;
+
+    const double ops = 2.0 * M * K * N;
+    const double hbm_gbps = opt.hbm_gbps > 0 ? opt.hbm_gbps : 14.375 * (2 * WGT_CHANNELS + 2);  // 460 GB/s / 32 per channel
+    r.gops = ops / (r.kernel_us_median * 1e3);
+    r.hbm_gbs = r.hbm_bytes / (r.kernel_us_median * 1e3);
+    r.peak_gops = 2.0 * PE_ROWS * PE_COLS * opt.clock_mhz / 1e3;
+    r.pct_peak = 100.0 * r.gops / r.peak_gops;
+    r.intensity = ops / r.hbm_bytes;
+    r.attainable_gops = std::min(r.peak_gops, r.intensity * hbm_gbps);
+    r.memory_bound = r.intensity * hbm_gbps < r.peak_gops;
+    return r;
+}
+
+void write_bench_csv(const std::string& path, const std::string& bitstream, const std::vector<BenchResult>& results) {
+    std::ofstream f(path);
+    if (!f) throw std::runtime_error("cannot write " + path);
+    f << "bitstream,config,M,K,N,iters,kernel_us_min,kernel_us_median,kernel_us_mean,wall_us_mean,transfer_us_mean,"
+         "h2d_bytes,d2h_bytes,hbm_bytes,gops,hbm_gbs,peak_gops,pct_peak,ops_per_byte,attainable_gops,bound\n";
+    for (const BenchResult& r : results) {
+        f << bitstream << "," << kernel_config() << "," << r.shape.M << "," << r.shape.K << "," << r.shape.N << ","
+          << r.iters << "," << r.kernel_us_min << "," << r.kernel_us_median << "," << r.kernel_us_mean << ","
+          << r.wall_us_mean << "," << r.transfer_us_mean << "," << r.h2d_bytes << "," << r.d2h_bytes << ","
+          << r.hbm_bytes << "," << r.gops << "," << r.hbm_gbs << "," << r.peak_gops << "," << r.pct_peak << ","
+          << r.intensity << "," << r.attainable_gops << "," << (r.memory_bound ? "memory" : "compute") << "\n";
+    }
+}
+
+static std::string json_escape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+void write_bench_json(const std::string& path, const std::string& bitstream, const std::vector<BenchResult>& results) {
+    std::ofstream f(path);
+    if (!f) throw std::runtime_error("cannot write " + path);
+    f << "{\n  \"bitstream\": \"" << json_escape(bitstream) << "\",\n  \"config\": \"" << kernel_config() << "\",\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        f << (i ? "," : "") << "\n    {\"M\": " << r.shape.M << ", \"K\": " << r.shape.K << ", \"N\": " << r.shape.N
+          << ", \"iters\": " << r.iters
+          << ", \"kernel_us\": {\"min\": " << r.kernel_us_min << ", \"median\": " << r.kernel_us_median
+          << ", \"mean\": " << r.kernel_us_mean << "}"
+          << ", \"wall_us_mean\": " << r.wall_us_mean << ", \"transfer_us_mean\": " << r.transfer_us_mean
+          << ", \"h2d_bytes\": " << r.h2d_bytes << ", \"d2h_bytes\": " << r.d2h_bytes
+          << ", \"hbm_bytes\": " << r.hbm_bytes << ", \"gops\": " << r.gops << ", \"hbm_gbs\": " << r.hbm_gbs
+          << ", \"peak_gops\": " << r.peak_gops << ", \"pct_peak\": " << r.pct_peak
+          << ", \"ops_per_byte\": " << r.intensity << ", \"attainable_gops\": " << r.attainable_gops
+          << ", \"bound\": \"" << (r.memory_bound ? "memory" : "compute") << "\"}";
+    }
+    f << "\n  ]\n}\n";
+}
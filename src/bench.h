@@ -0,0 +1,68 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "host.h"
+
+// ============================================================================
+// Kernel benchmark: warmup plus timed iterations of one CMD_RUN call per
+// shape, with achieved GOPS, HBM traffic and roofline position
+//
+// "Kernel" time is what tapa::invoke reports for the kernel itself; "wall"
+// is the whole invoke_kernel call, so wall - kernel is the host-to-device
+// and device-to-host buffer traffic (tapa::invoke does not time the two
+// directions separately; their bytes are reported instead). The HBM bytes
+// are what the kernel moves: activations once, weights and scales once per
+// weight pass, results once.
+// ============================================================================
+struct BenchShape {
+    int M = 0;
+    int K = 0;
+    int N = 0;
+};
+
+struct BenchOptions {
+    int warmup = 2;
+    int iters = 10;
+    double clock_mhz = 300.0;  // kernel clock for the peak
+    double hbm_gbps = 0.0;     // bandwidth the kernel can reach (0: its bound pseudo-channels)
+};
+
+struct BenchResult {
+    BenchShape shape;
+    int iters = 0;
+    double kernel_us_min = 0, kernel_us_median = 0, kernel_us_mean = 0;
+    double wall_us_mean = 0;
+    double transfer_us_mean = 0;    // wall - kernel
+    int64_t h2d_bytes = 0;          // activations, weights, scales
+    int64_t d2h_bytes = 0;          // results
+    int64_t hbm_bytes = 0;          // moved by the kernel per call
+    double gops = 0;                // at the median kernel time
+    double hbm_gbs = 0;
+    double peak_gops = 0;           // PE_ROWS x PE_COLS MACs per cycle
+    double pct_peak = 0;
+    double intensity = 0;           // ops per HBM byte
+    double attainable_gops = 0;     // roofline: min(peak, intensity x bandwidth)
+    bool memory_bound = false;
+};
+
+// "64x256x512,1x4096x14336" -> shapes (M x K x N); throws std::invalid_argument
+std::vector<BenchShape> parse_shapes(const std::string& list);
+
+BenchResult run_benchmark(
+    const std::string& bitstream,
+    Backend backend,
+    const BenchShape& shape,
+    const BenchOptions& opt
+);
+
+// Build options of this binary, e.g. "16x16 broadcast tile shift ch8"
+std::string kernel_config();
+
+void write_bench_csv(const std::string& path, const std::string& bitstream, const std::vector<BenchResult>& results);
+void write_bench_json(const std::string& path, const std::string& bitstream, const std::vector<BenchResult>& results);
+
+#endif
@@ -0,0 +1,83 @@
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+#include "chain.h"
+
+void LayerChain::add_layer(
+    const aligned_vector<uint8_t>& wgt_packed,
+    const aligned_vector<uint8_t>& scales,
+    int K, int N,
+    const EpilogueParams& epi
+) {
+    if (K < 1 || K > K_DIM || N < 1 || epi.epi == EPI_OFF || epi.N != N) {
+        throw std::invalid_argument("LayerChain: needs 1 <= K <= K_DIM and an epilogue made for N");
+    }
+    if (!layers_.empty() && layers_.back().N != K) {
+        throw std::invalid_argument("LayerChain: a layer's K must be the previous layer's N");
+    }
+    layers_.emplace_back();
+    Layer& l = layers_.back();
+    l.K = K;
+    l.N = N;
+    l.wgt_packed = wgt_packed;
+    l.scales = scales;
+    l.epi = epi;
+    shard_weights(l.wgt_packed, l.scales, l.wgt_shards, l.scale_shards, K, N);
+}
+
+int64_t LayerChain::run(
+    const std::string& bitstream,
+    Backend backend,
+    aligned_vector<int8_t>& act,
+    int8_t* out, int out_stride,
+    int M
+) {
+    if (layers_.empty()) throw std::invalid_argument("LayerChain: no layers");
+    const int LAST = layers() - 1;
+    for (int l = 0; l < LAST; l++) {
+        if (!chain_fits(M, layers_[l].N)) {
+            throw std::invalid_argument("LayerChain: chained results hold at most one M-block of K_DIM columns");
+        }
+    }
+    auto t0 = std::chrono::steady_clock::now();
+
+    if (backend == Backend::FPGA) {
+        // The chained calls never touch activations past the first layer or
+        // a result port before the last
+        no_q8_.assign(PE_COLS, 0);
+        q8_.assign((size_t)M * out_row_stride(layers_[LAST].N), 0);
+        for (int l = 0; l <= LAST; l++) {
+            Layer& layer = layers_[l];
+            const int chain = (l > 0 ? CHAIN_IN : 0) | (l < LAST ? CHAIN_OUT : 0);
+            invoke_kernel(bitstream, act, view_shards(layer.wgt_shards, layer.scale_shards), layer.epi,
+                          l < LAST ? no_q8_ : q8_, M, layer.K, layer.N, CMD_RUN, chain);
+        }
+        const int stride = out_row_stride(layers_[LAST].N);
+        for (int m = 0; m < M; m++) {
+            std::copy_n(&q8_[(size_t)m * stride], layers_[LAST].N, &out[(size_t)m * out_stride]);
+        }
+    } else {
+        // Each int8 result becomes the next layer's activations (zero padded
+        // to whole words), exactly what A_chain hands the array
+        const aligned_vector<int8_t>* in = &act;
+        for (int l = 0; l <= LAST; l++) {
+            Layer& layer = layers_[l];
+            if (layer.cpu_wgt.N != layer.N) {
+                prepare_cpu_weights(layer.wgt_packed, layer.scales, layer.cpu_wgt, layer.K, layer.N);
+            }
+            const int acc_stride = out_row_stride(layer.N);
+            cpu_acc_.assign((size_t)M * acc_stride, 0);
+            cpu_gemm(*in, layer.cpu_wgt, cpu_acc_.data(), acc_stride, M);
+            if (l == LAST) {
+                apply_epilogue(cpu_acc_.data(), acc_stride, layer.epi, out, out_stride, M);
+            } else {
+                aligned_vector<int8_t>& next = cpu_act_[l % 2];
+                next.assign((size_t)M * act_row_stride(layer.N), 0);
+                apply_epilogue(cpu_acc_.data(), acc_stride, layer.epi, next.data(), act_row_stride(layer.N), M);
+                in = &next;
+            }
+        }
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+}
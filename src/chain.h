@@ -0,0 +1,69 @@
+#ifndef CHAIN_H_
+#define CHAIN_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "host.h"
+
+// ============================================================================
+// LayerChain: consecutive layers (e.g. an MLP's up- and down-projection)
+// whose intermediate results never leave the FPGA
+//
+// Every layer runs with its fused int8 epilogue. Layer l is one kernel call
+// with CHAIN_OUT, so its result stays in A_chain on chip, and layer l + 1
+// takes it with CHAIN_IN as its activations; only the first layer reads
+// activations from HBM and only the last one stores its result. The chained
+// results must fit one M-block (M <= ACT_CACHE_SIZE * PE_ROWS) and every
+// layer's K is the previous layer's N. With Backend::CPU the same chain runs
+// through cpu_gemm and apply_epilogue.
+// ============================================================================
+class LayerChain {
+ public:
+    LayerChain() = default;
+    LayerChain(const LayerChain&) = delete;
+    LayerChain& operator=(const LayerChain&) = delete;
+
+    // Append a K x N layer in the padded MXINT4 layout of pack_weights()
+    // with its epilogue (made for N)
+    void add_layer(
+        const aligned_vector<uint8_t>& wgt_packed,
+        const aligned_vector<uint8_t>& scales,
+        int K, int N,
+        const EpilogueParams& epi
+    );
+
+    int layers() const { return (int)layers_.size(); }
+
+    // out[m * out_stride + n] = int8 result of the last layer for M rows of
+    // activations in the kernel layout (M x act_row_stride(K) of the first
+    // layer). Returns the time of the whole chain in nanoseconds.
+    int64_t run(
+        const std::string& bitstream,
+        Backend backend,
+        aligned_vector<int8_t>& act,
+        int8_t* out, int out_stride,
+        int M
+    );
+
+ private:
+    struct Layer {
+        int K = 0;
+        int N = 0;
+        aligned_vector<uint8_t> wgt_packed;
+        aligned_vector<uint8_t> scales;
+        shard_array_t wgt_shards;
+        shard_array_t scale_shards;
+        CpuWeights cpu_wgt;  // Backend::CPU, prepared on first use
+        EpilogueParams epi;
+    };
+
+    std::vector<Layer> layers_;
+    aligned_vector<int8_t> q8_;          // last layer's result, M x out_row_stride(N)
+    aligned_vector<int8_t> no_q8_;       // result port of the chained calls (not written)
+    aligned_vector<int32_t> cpu_acc_;    // Backend::CPU
+    aligned_vector<int8_t> cpu_act_[2];
+};
+
+#endif
@@ -0,0 +1,1138 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include <sys/mman.h>
+
+#include "host.h"
+
+// Run fn(begin, end) over [0, count) split into contiguous ranges, one per
+// hardware thread, but never less than min_per_thread items per range
+template <typename Fn>
+static void parallel_for(int count, int min_per_thread, Fn fn) {
+    int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = std::max(1, std::min(num_threads, count / std::max(1, min_per_thread)));
+    
+    const int chunk = num_tiles(count, num_threads);
+    std::vector<std::thread> workers;
+    for (int t = 1; t < num_threads; t++) {
+        workers.emplace_back(fn, std::min(count, t * chunk), std::min(count, (t + 1) * chunk));
+    }
+    fn(0, std::min(count, chunk));
+    for (auto& w : workers) w.join();
+}
+
+// ============================================================================
+// MXINT4 quantization
+//
+// Every group of wgt_fmt (GROUP_SIZE weights along N or along K) shares one
+// exponent picked from its largest magnitude; weights are divided by the
+// group scale, rounded half away from zero and clamped to [-8, 7].
+//   2-bit shift: s = clamp(floor(log2(max_abs)) - 3, 0, 3), scale 4^s
+//   E8M0:        X = clamp(floor(log2(max_abs)) - 2, min_exp, max_exp),
+//                scale 2^X (max_abs / 2^X lands in [4, 8))
+// quantize_mxint4_reference is the scalar definition; the fast path must
+// match it bit for bit.
+// ============================================================================
+
+// Exponent byte of a group whose largest magnitude is max_abs
+static uint8_t group_exponent(float max_abs) {
+    if (wgt_fmt::exp_bits == 2) {
+        int shift = 0;
+        if (max_abs > 0.0f) {
+            shift = (int)std::floor(std::log2(max_abs)) - 3;
+            shift = std::max(0, std::min(3, shift));  // Limit to [0, 3] -> shift by 0,2,4,6
+        }
+        return (uint8_t)shift;
+    }
+    int x = wgt_fmt::min_exp;
+    if (max_abs > 0.0f) {
+        x = (int)std::floor(std::log2(max_abs)) - 2;
+        x = std::max(wgt_fmt::min_exp, std::min(wgt_fmt::max_exp, x));
+    }
+    return (uint8_t)(x + wgt_fmt::exp_bias);
+}
+
+// One weight -> 4-bit nibble under exponent byte e
+static uint8_t quantize_weight(float w, uint8_t e) {
+    if (wgt_fmt::exp_bits == 2) {
+        float scale_val = std::pow(2.0f, e * 2);  // e * 2 because Sw[1:0]*2
+        int8_t q = (int8_t)std::round(w / scale_val);
+        q = std::max((int8_t)-8, std::min((int8_t)7, q));
+        return q & 0x0F;
+    }
+    // w / 2^X is exact; clamp before the integer conversion
+    float q = std::round(std::ldexp(w, wgt_fmt::exp_bias - (int)e));
+    q = std::max(-8.0f, std::min(7.0f, q));
+    return (int8_t)q & 0x0F;
+}
+
+// Group exponents of scale rows [begin, end): one group for GROUP_ALONG_N,
+// one GROUP_SIZE-row block of the matrix for GROUP_ALONG_K
+static void quantize_exponents(const float* w, uint8_t* scales, int K, int N, int begin, int end) {
+    if (!wgt_fmt::along_k) {
+        const int total_weights = K * N;
+        for (int grp = begin; grp < end; grp++) {
+            float max_abs = 0.0f;
+            for (int i = grp * GROUP_SIZE; i < std::min(total_weights, (grp + 1) * GROUP_SIZE); i++) {
+                max_abs = std::max(max_abs, std::fabs(w[i]));
+            }
+            scales[grp] = group_exponent(max_abs);
+        }
+        return;
+    }
+    std::vector<float> max_abs(N);
+    for (int kb = begin; kb < end; kb++) {
+        std::fill(max_abs.begin(), max_abs.end(), 0.0f);
+        for (int k = kb * GROUP_SIZE; k < std::min(K, (kb + 1) * GROUP_SIZE); k++) {
+            for (int n = 0; n < N; n++) {
+                max_abs[n] = std::max(max_abs[n], std::fabs(w[k * N + n]));
+            }
+        }
+        for (int n = 0; n < N; n++) {
+            scales[kb * N + n] = group_exponent(max_abs[n]);
+        }
+    }
+}
+
+// Packed bytes [begin, end); an odd tail pads the upper nibble with 0
+static void quantize_nibbles(const float* w, const uint8_t* scales, uint8_t* packed, int K, int N,
+                             int begin, int end) {
+    const int total_weights = K * N;
+    for (int b = begin; b < end; b++) {
+        uint8_t byte = 0;
+        for (int i = 2 * b; i < std::min(total_weights, 2 * b + 2); i++) {
+            byte |= quantize_weight(w[i], scales[scale_index(i / N, i % N, N)]) << (4 * (i & 1));
+        }
+        packed[b] = byte;
+    }
+}
+
+static int num_scale_rows(int K, int N) {
+    return wgt_fmt::along_k ? num_tiles(K, GROUP_SIZE) : num_scales(K, N);
+}
+
+void quantize_mxint4_reference(
+    const std::vector<float>& weights_fp32,
+    aligned_vector<uint8_t>& weights_packed,
+    aligned_vector<uint8_t>& scales,
+    int K, int N
+) {
+    const int total_weights = K * N;
+    weights_packed.assign((total_weights + 1) / 2, 0);
+    scales.assign(num_scales(K, N), 0);
+    
+    quantize_exponents(weights_fp32.data(), scales.data(), K, N, 0, num_scale_rows(K, N));
+    quantize_nibbles(weights_fp32.data(), scales.data(), weights_packed.data(), K, N,
+                     0, (int)weights_packed.size());
+}
+
+#if defined(__AVX2__) && SA_EXP_BITS == 2 && SA_GROUP_AXIS == 0 && SA_GROUP_SIZE == 16
+#define SA_AVX2_QUANT 1
+
+// One (possibly partial) group of the original format, scalar. Writes
+// (len + 1) / 2 bytes.
+static void quantize_group_scalar(const float* w, int len, uint8_t* packed, uint8_t& scale) {
+    float max_abs = 0.0f;
+    for (int i = 0; i < len; i++) {
+        max_abs = std::max(max_abs, std::fabs(w[i]));
+    }
+    scale = group_exponent(max_abs);
+    for (int i = 0; i < len; i += 2) {
+        uint8_t w1 = (i + 1 < len) ? quantize_weight(w[i + 1], scale) : 0;
+        packed[i / 2] = quantize_weight(w[i], scale) | (w1 << 4);
+    }
+}
+
+// Smallest max_abs for which the scalar rule picks shift >= s (s = 1..3),
+// i.e. floor(log2(max_abs)) >= s + 3. Probed against std::log2 itself so
+// the comparison agrees with the reference even where log2 rounds up just
+// below a power of two.
+static const std::array<float, 3>& shift_thresholds() {
+    static const std::array<float, 3> thresholds = [] {
+        std::array<float, 3> t;
+        for (int s = 1; s <= 3; s++) {
+            const int e = s + 3;
+            auto picks = [e](float x) { return (int)std::floor(std::log2(x)) >= e; };
+            float x = std::ldexp(1.0f, e);
+            while (!picks(x)) x = std::nextafter(x, INFINITY);
+            while (picks(std::nextafter(x, 0.0f))) x = std::nextafter(x, 0.0f);
+            t[s - 1] = x;
+        }
+        return t;
+    }();
+    return thresholds;
+}
+
+// 8 weights -> 8 clamped nibbles (one per 32-bit lane), matching the scalar
+// (int8_t)std::round(w / 4^s) followed by the [-8, 7] clamp
+static inline __m256i quantize8_avx2(__m256 w, __m256 inv_scale) {
+    const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    
+    // w * 4^-s == w / 4^s exactly (both correctly rounded, 4^-s exact)
+    __m256 q = _mm256_mul_ps(w, inv_scale);
+    
+    // Round half away from zero: q - trunc(q) is exact
+    __m256 t = _mm256_round_ps(q, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    __m256 frac = _mm256_andnot_ps(sign_mask, _mm256_sub_ps(q, t));
+    __m256 step = _mm256_or_ps(_mm256_and_ps(q, sign_mask), _mm256_set1_ps(1.0f));
+    __m256 bump = _mm256_and_ps(_mm256_cmp_ps(frac, _mm256_set1_ps(0.5f), _CMP_GE_OQ), step);
+    __m256i r = _mm256_cvttps_epi32(_mm256_add_ps(t, bump));
+    
+    // Narrow to int8 the way the scalar cast does, then clamp
+    r = _mm256_srai_epi32(_mm256_slli_epi32(r, 24), 24);
+    r = _mm256_max_epi32(_mm256_min_epi32(r, _mm256_set1_epi32(7)), _mm256_set1_epi32(-8));
+    return _mm256_and_si256(r, _mm256_set1_epi32(0x0F));
+}
+
+// One full group of 16 weights
+static inline void quantize_group_avx2(
+    const float* w, uint8_t* packed, uint8_t& scale, const std::array<float, 3>& thr
+) {
+    static_assert(GROUP_SIZE == 16, "AVX2 quantizer handles 16-weight groups");
+    const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    
+    __m256 w0 = _mm256_loadu_ps(w);
+    __m256 w1 = _mm256_loadu_ps(w + 8);
+    
+    // max |w|, NaNs ignored like std::max in the reference
+    __m256 a0 = _mm256_andnot_ps(sign_mask, w0);
+    __m256 a1 = _mm256_andnot_ps(sign_mask, w1);
+    a0 = _mm256_and_ps(a0, _mm256_cmp_ps(a0, a0, _CMP_ORD_Q));
+    a1 = _mm256_and_ps(a1, _mm256_cmp_ps(a1, a1, _CMP_ORD_Q));
+    __m256 m = _mm256_max_ps(a0, a1);
+    m = _mm256_max_ps(m, _mm256_permute2f128_ps(m, m, 1));
+    m = _mm256_max_ps(m, _mm256_shuffle_ps(m, m, 0x4E));
+    m = _mm256_max_ps(m, _mm256_shuffle_ps(m, m, 0xB1));
+    float max_abs = _mm256_cvtss_f32(m);
+    
+    int shift = (max_abs >= thr[0]) + (max_abs >= thr[1]) + (max_abs >= thr[2]);
+    scale = (uint8_t)shift;
+    __m256 inv_scale = _mm256_set1_ps(1.0f / (float)(1 << (2 * shift)));
+    
+    // Even lane -> low nibble: fold the odd lane of every 64-bit pair down
+    // by 28 bits, then collect byte 0 of each pair
+    __m256i n0 = quantize8_avx2(w0, inv_scale);
+    __m256i n1 = quantize8_avx2(w1, inv_scale);
+    n0 = _mm256_or_si256(n0, _mm256_srli_epi64(n0, 28));
+    n1 = _mm256_or_si256(n1, _mm256_srli_epi64(n1, 28));
+    __m256i b = _mm256_packus_epi32(
+        _mm256_and_si256(n0, _mm256_set1_epi64x(0xFF)),
+        _mm256_and_si256(n1, _mm256_set1_epi64x(0xFF))
+    );  // per 128-bit lane: n0 pairs, n1 pairs as 16-bit words
+    b = _mm256_packus_epi16(b, b);       // -> bytes
+    b = _mm256_packus_epi16(b, b);
+    // lane 0: n0[0..1] n1[0..1], lane 1: n0[2..3] n1[2..3]
+    uint32_t lo = (uint32_t)_mm256_extract_epi32(b, 0);
+    uint32_t hi = (uint32_t)_mm256_extract_epi32(b, 4);
+    uint8_t out[8] = {
+        (uint8_t)lo, (uint8_t)(lo >> 8), (uint8_t)hi, (uint8_t)(hi >> 8),
+        (uint8_t)(lo >> 16), (uint8_t)(lo >> 24), (uint8_t)(hi >> 16), (uint8_t)(hi >> 24),
+    };
+    std::memcpy(packed, out, 8);
+}
+#endif
+
+// Quantize weights to MXINT4 with group-wise scaling, split across
+// threads. The original format's full groups take the AVX2 path when it is
+// compiled in; otherwise exponents and then packed bytes are computed in
+// parallel ranges.
+void quantize_mxint4(
+    const std::vector<float>& weights_fp32,
+    aligned_vector<uint8_t>& weights_packed,
+    aligned_vector<uint8_t>& scales,
+    int K, int N
+) {
+#ifndef SA_AVX2_QUANT
+    const float* w = weights_fp32.data();
+    weights_packed.assign(((size_t)K * N + 1) / 2, 0);
+    scales.assign(num_scales(K, N), 0);
+    uint8_t* packed = weights_packed.data();
+    uint8_t* scale = scales.data();
+    
+    // Small tensors are not worth the thread start-up
+    parallel_for(num_scale_rows(K, N), wgt_fmt::along_k ? 1 : 1 << 14, [=](int begin, int end) {
+        quantize_exponents(w, scale, K, N, begin, end);
+    });
+    parallel_for((int)weights_packed.size(), 1 << 17, [=](int begin, int end) {
+        quantize_nibbles(w, scale, packed, K, N, begin, end);
+    });
+#else
+    const int total_weights = K * N;
+    const int num_groups = (total_weights + GROUP_SIZE - 1) / GROUP_SIZE;
+    const int full_groups = total_weights / GROUP_SIZE;
+    weights_packed.assign((total_weights + 1) / 2, 0);
+    scales.resize(num_groups);
+    
+    const float* src = weights_fp32.data();
+    uint8_t* packed = weights_packed.data();
+    uint8_t* scale = scales.data();
+    
+    auto quantize_range = [=](int begin, int end) {
+        const std::array<float, 3>& thr = shift_thresholds();
+        for (int grp = begin; grp < end; grp++) {
+            quantize_group_avx2(&src[grp * GROUP_SIZE], &packed[grp * GROUP_SIZE / 2], scale[grp], thr);
+        }
+    };
+    
+    // Small tensors are not worth the thread start-up
+    parallel_for(full_groups, 1 << 14, quantize_range);
+    
+    // Partial last group
+    if (full_groups < num_groups) {
+        int base_idx = full_groups * GROUP_SIZE;
+        quantize_group_scalar(&src[base_idx], total_weights - base_idx,
+                              &packed[base_idx / 2], scale[full_groups]);
+    }
+#endif
+}
+
+void pack_weights(
+    const std::vector<float>& wgt_fp32,
+    aligned_vector<uint8_t>& wgt_packed,
+    aligned_vector<uint8_t>& scales,
+    int K, int N
+) {
+    const int N_STRIDE = wgt_row_stride(N);
+    
+    // Pad columns are zero
+    std::vector<float> wgt_padded(K * N_STRIDE, 0.0f);
+    for (int k = 0; k < K; k++) {
+        std::copy(&wgt_fp32[k * N], &wgt_fp32[k * N] + N, &wgt_padded[k * N_STRIDE]);
+    }
+    quantize_mxint4(wgt_padded, wgt_packed, scales, K, N_STRIDE);
+    scales.resize(round_up(scales.size(), AXI_BYTES), 0);
+}
+
+void slice_weights(
+    const aligned_vector<uint8_t>& wgt_packed,
+    const aligned_vector<uint8_t>& scales,
+    int K, int N,
+    int n_begin, int n_count,
+    aligned_vector<uint8_t>& slice_packed,
+    aligned_vector<uint8_t>& slice_scales
+) {
+    if (n_begin % PE_COLS != 0 || n_count < 1 || n_begin + n_count > N) {
+        throw std::invalid_argument("slice_weights: columns must be whole N-tiles inside the layer");
+    }
+    const int N_STRIDE = wgt_row_stride(N);
+    const int SLICE_STRIDE = wgt_row_stride(n_count);
+    
+    // Nibbles: n_begin is even, so each row is a plain byte range
+    slice_packed.assign((size_t)K * SLICE_STRIDE / 2, 0);
+    for (int k = 0; k < K; k++) {
+        std::copy_n(&wgt_packed[((size_t)k * N_STRIDE + n_begin) / 2], (n_count + 1) / 2,
+                    &slice_packed[(size_t)k * SLICE_STRIDE / 2]);
+        if (n_count % 2) slice_packed[((size_t)k * SLICE_STRIDE + n_count) / 2] &= 0x0F;
+    }
+    
+    // One exponent per group; groups never straddle an N-tile
+    slice_scales.assign(round_up(num_scales(K, SLICE_STRIDE), AXI_BYTES), 0);
+    const int K_STEP = wgt_fmt::along_k ? GROUP_SIZE : 1;
+    const int N_STEP = wgt_fmt::along_k ? 1 : GROUP_SIZE;
+    for (int k = 0; k < K; k += K_STEP) {
+        for (int n = 0; n < n_count; n += N_STEP) {
+            slice_scales[scale_index(k, n, SLICE_STRIDE)] = scales[scale_index(k, n_begin + n, N_STRIDE)];
+        }
+    }
+}
+
+// ============================================================================
+// Activation compression (SA_ACT_INT4)
+//
+// Each ACT_BLOCK values of a row take the smallest shift e under which none
+// of their mantissas a / 2^e (rounded half away from zero) leaves [-8, 7],
+// or ACT_MAX_SHIFT with clamping.
+// ============================================================================
+static int act_mantissa(int a, int e) {
+    const int mag = e ? (std::abs(a) + (1 << (e - 1))) >> e : std::abs(a);
+    return a < 0 ? -mag : mag;
+}
+
+static int act_block_shift(const int8_t* a, int len) {
+    for (int e = 0; e < ACT_MAX_SHIFT; e++) {
+        if (std::all_of(a, a + len, [e](int8_t v) { int q = act_mantissa(v, e); return q >= -8 && q <= 7; })) return e;
+    }
+    return ACT_MAX_SHIFT;
+}
+
+// fn(k, q, e) for every value of row a
+template <typename Fn>
+static void for_act_blocks(const int8_t* a, int K, Fn fn) {
+    for (int k0 = 0; k0 < K; k0 += ACT_BLOCK) {
+        const int len = std::min(ACT_BLOCK, K - k0);
+        const int e = act_block_shift(a + k0, len);
+        for (int k = k0; k < k0 + len; k++) {
+            fn(k, std::max(-8, std::min(7, act_mantissa(a[k], e))), e);
+        }
+    }
+}
+
+void round_activations(int8_t* act, int M, int K, int stride) {
+#if SA_ACT_INT4
+    parallel_for(M, 16, [&](int begin, int end) {
+        for (int m = begin; m < end; m++) {
+            int8_t* row = act + (size_t)m * stride;
+            for_act_blocks(row, K, [&](int k, int q, int e) { row[k] = (int8_t)(q * (1 << e)); });
+        }
+    });
+#else
+    (void)act; (void)M; (void)K; (void)stride;  // int8 activations are exact
+#endif
+}
+
+void compress_activations(const int8_t* act, int M, int K, aligned_vector<int8_t>& port) {
+    port.assign(act_port_bytes(M, K), 0);
+    const int K_STRIDE = act_row_stride(K);
+#if SA_ACT_INT4
+    const size_t ROW_BYTES = (size_t)act_row_words(K) * AXI_BYTES;
+    const size_t EXP_BASE = (size_t)M * ROW_BYTES;
+    const size_t EXP_ROW_BYTES = (size_t)act_exp_row_words(K) * AXI_BYTES;
+    parallel_for(M, 16, [&](int begin, int end) {
+        for (int m = begin; m < end; m++) {
+            uint8_t* mant = (uint8_t*)&port[m * ROW_BYTES];
+            uint8_t* exps = (uint8_t*)&port[EXP_BASE + m * EXP_ROW_BYTES];
+            for_act_blocks(act + (size_t)m * K_STRIDE, K, [&](int k, int q, int e) {
+                mant[k / 2] |= (uint8_t)((q & 0xF) << (4 * (k % 2)));
+                exps[k / ACT_BLOCK] = (uint8_t)e;
+            });
+        }
+    });
+#else
+    std::copy_n(act, (size_t)M * K_STRIDE, port.data());
+#endif
+}
+
+// Split the padded MXINT4 matrix into WGT_CHANNELS HBM shards by N-tile:
+// tile t goes to shard t % WGT_CHANNELS as local tile t / WGT_CHANNELS, in
+// the build's shard layout (wgt_col_offset). Tiles past N stay zero.
+void shard_weights(
+    const aligned_vector<uint8_t>& wgt_packed,
+    const aligned_vector<uint8_t>& scales,
+    shard_array_t& wgt_shards,
+    shard_array_t& scale_shards,
+    int K, int N
+) {
+    const int N_STRIDE = wgt_row_stride(N);
+    const int N_TILES = num_tiles(N, PE_COLS);  // pad tiles are all zero
+    
+    for (int c = 0; c < WGT_CHANNELS; c++) {
+        wgt_shards[c].assign(wgt_shard_bytes(K, N), 0);
+        scale_shards[c].assign(scale_shard_bytes(K, N), 0);
+    }
+    
+    // Tile-outer so tile-major shards are written sequentially
+    for (int t = 0; t < N_TILES; t++) {
+        auto& w = wgt_shards[t % WGT_CHANNELS];
+        auto& s = scale_shards[t % WGT_CHANNELS];
+        for (int k = 0; k < K; k++) {
+            int src = k * N_STRIDE + t * PE_COLS;
+            std::copy_n(&wgt_packed[src / 2], COL_BYTES, &w[wgt_col_offset(K, N, k, t / WGT_CHANNELS)]);
+            std::copy_n(&scales[scale_index(k, t * PE_COLS, N_STRIDE)], COL_SCALES,
+                        &s[scale_col_offset(K, N, k, t / WGT_CHANNELS)]);
+        }
+    }
+
+#if SA_WGT_SPARSE
+    // Block index of every local tile (pad tiles have no blocks). A zero
+    // nibble is a zero weight whatever its exponent, so a block is skipped
+    // when all of its packed bytes are zero.
+    const int K_PAD = wgt_tile_words(K) * COLS_PER_WORD;
+    for (int c = 0; c < WGT_CHANNELS; c++) {
+        auto& w = wgt_shards[c];
+        for (int lt = 0; lt < wgt_shard_tiles(N); lt++) {
+            uint8_t* index = &w[(size_t)sparse_index_word(K, N, lt) * AXI_BYTES];
+            int count = 0;
+            for (int b = 0; b < sparse_blocks(K); b++) {
+                const int k_end = std::min((b + 1) * SPARSE_BLOCK, K_PAD);
+                const uint8_t* blk = &w[wgt_col_offset(K, N, b * SPARSE_BLOCK, lt)];
+                if (std::any_of(blk, blk + (k_end - b * SPARSE_BLOCK) * COL_BYTES, [](uint8_t x) { return x != 0; })) {
+                    ++count;
+                    index[2 * count] = b & 0xFF;
+                    index[2 * count + 1] = b >> 8;
+                }
+            }
+            index[0] = count & 0xFF;
+            index[1] = count >> 8;
+        }
+    }
+#endif
+}
+
+double weight_density(const WeightView& wgt, int K, int N) {
+#if SA_WGT_SPARSE
+    int64_t nonzero = 0;
+    for (int c = 0; c < WGT_CHANNELS; c++) {
+        for (int lt = 0; lt < wgt_shard_tiles(N); lt++) {
+            const uint8_t* index = wgt.packed[c] + (size_t)sparse_index_word(K, N, lt) * AXI_BYTES;
+            nonzero += index[0] | (index[1] << 8);
+        }
+    }
+    return (double)nonzero / ((int64_t)num_tiles(N, PE_COLS) * sparse_blocks(K));  // pad tiles count 0
+#else
+    (void)wgt; (void)K; (void)N;
+    return 1.0;
+#endif
+}
+
+void unshard_weights(
+    const WeightView& wgt,
+    aligned_vector<uint8_t>& wgt_packed,
+    aligned_vector<uint8_t>& scales,
+    int K, int N
+) {
+    const int N_STRIDE = wgt_row_stride(N);
+    const int N_TILES = num_tiles(N, PE_COLS);  // pad tiles are all zero
+    wgt_packed.assign(K * N_STRIDE / 2, 0);
+    scales.assign(round_up(num_scales(K, N_STRIDE), AXI_BYTES), 0);
+    
+    for (int t = 0; t < N_TILES; t++) {
+        const uint8_t* w = wgt.packed[t % WGT_CHANNELS];
+        const uint8_t* s = wgt.scales[t % WGT_CHANNELS];
+        for (int k = 0; k < K; k++) {
+            int dst = k * N_STRIDE + t * PE_COLS;
+            std::copy_n(&w[wgt_col_offset(K, N, k, t / WGT_CHANNELS)], COL_BYTES, &wgt_packed[dst / 2]);
+            std::copy_n(&s[scale_col_offset(K, N, k, t / WGT_CHANNELS)], COL_SCALES,
+                        &scales[scale_index(k, t * PE_COLS, N_STRIDE)]);
+        }
+    }
+}
+
+WeightView view_shards(const shard_array_t& wgt_shards, const shard_array_t& scale_shards) {
+    WeightView view;
+    for (int c = 0; c < WGT_CHANNELS; c++) {
+        view.packed[c] = wgt_shards[c].data();
+        view.scales[c] = scale_shards[c].data();
+    }
+    view.packed_bytes = wgt_shards[0].size();
+    view.scale_bytes = scale_shards[0].size();
+    return view;
+}
+
+// ============================================================================
+// CPU GEMM
+//
+// Weights are dequantized once into int16 panels of CPU_PANEL columns,
+// stored as (k, k+1) pairs so one madd multiplies two K steps of eight
+// columns against a broadcast activation pair. Each panel (K x 16 x 2B,
+// 128KB at K_DIM) stays in L2 while every row of A streams past it, and
+// panels are spread across threads. Sums are exact (acc_t, int32 lanes
+// per chunk) and rounded like the kernel's (wgt_fmt::finish), so the
+// result is identical.
+// ============================================================================
+static_assert(wgt_fmt::max_shift <= 12, "dequantized weights must fit int16 panels");
+
+static const int CPU_PANEL = 16;
+static const int CPU_ROWS = 4;  // output rows per register block
+// k-pairs an int32 lane can sum: |pair| <= 2 * 2^7 * 2^(3 + max_shift)
+static const int CPU_CHUNK = 1 << (20 - wgt_fmt::max_shift);
+
+// Panels of a K x N matrix whose dequantized weight (k, n) is weight(k, n)
+template <typename Fn>
+static void fill_panels(CpuWeights& wgt, int K, int N, Fn weight) {
+    const int K_PAIRS = num_tiles(K, 2);
+    const int NUM_PANELS = num_tiles(N, CPU_PANEL);
+    wgt.K = K;
+    wgt.N = N;
+    wgt.panels.assign((size_t)NUM_PANELS * K_PAIRS * CPU_PANEL * 2, 0);
+    
+    parallel_for(NUM_PANELS, 4, [&](int begin, int end) {
+        for (int p = begin; p < end; p++) {
+            int16_t* panel = &wgt.panels[(size_t)p * K_PAIRS * CPU_PANEL * 2];
+            for (int k = 0; k < K; k++) {
+                for (int j = 0; j < CPU_PANEL; j++) {
+                    int n = p * CPU_PANEL + j;
+                    if (n >= N) break;
+                    panel[((k / 2) * CPU_PANEL + j) * 2 + k % 2] = weight(k, n);
+                }
+            }
+        }
+    });
+}
+
+void prepare_cpu_weights(
+    const aligned_vector<uint8_t>& wgt_packed,
+    const aligned_vector<uint8_t>& scales,
+    CpuWeights& wgt,
+    int K, int N
+) {
+    const int N_STRIDE = wgt_row_stride(N);
+    fill_panels(wgt, K, N, [&](int k, int n) -> wgt_t {
+        int w_idx = k * N_STRIDE + n;
+        return wgt_fmt::dequant(wgt_packed[w_idx / 2], w_idx % 2 == 1, scales[scale_index(k, n, N_STRIDE)]);
+    });
+}
+
+// ROWS x CPU_PANEL block of C over the full K. Lanes sum CPU_CHUNK k-pairs
+// in int32, then each chunk is added into an acc_t total.
+template <int ROWS>
+static void gemm_block(
+    const int32_t* a_pairs, int K_PAIRS,
+    const int16_t* panel,
+    int32_t* out, int out_stride, int cols
+) {
+    acc_t total[ROWS][CPU_PANEL] = {};
+    for (int kp0 = 0; kp0 < K_PAIRS; kp0 += CPU_CHUNK) {
+        const int kp_end = std::min(K_PAIRS, kp0 + CPU_CHUNK);
+        int32_t acc[ROWS][CPU_PANEL];
+#ifdef __AVX2__
+        __m256i acc_lo[ROWS], acc_hi[ROWS];
+        for (int r = 0; r < ROWS; r++) {
+            acc_lo[r] = _mm256_setzero_si256();
+            acc_hi[r] = _mm256_setzero_si256();
+        }
+        for (int kp = kp0; kp < kp_end; kp++) {
+            __m256i w_lo = _mm256_load_si256((const __m256i*)&panel[kp * CPU_PANEL * 2]);
+            __m256i w_hi = _mm256_load_si256((const __m256i*)&panel[kp * CPU_PANEL * 2 + 16]);
+            for (int r = 0; r < ROWS; r++) {
+                __m256i a = _mm256_set1_epi32(a_pairs[r * K_PAIRS + kp]);
+                acc_lo[r] = _mm256_add_epi32(acc_lo[r], _mm256_madd_epi16(w_lo, a));
+                acc_hi[r] = _mm256_add_epi32(acc_hi[r], _mm256_madd_epi16(w_hi, a));
+            }
+        }
+        for (int r = 0; r < ROWS; r++) {
+            _mm256_storeu_si256((__m256i*)&acc[r][0], acc_lo[r]);
+            _mm256_storeu_si256((__m256i*)&acc[r][8], acc_hi[r]);
+        }
+#else
+        for (int r = 0; r < ROWS; r++) {
+            std::fill_n(acc[r], CPU_PANEL, 0);
+        }
+        for (int kp = kp0; kp < kp_end; kp++) {
+            const int16_t* w = &panel[kp * CPU_PANEL * 2];
+            for (int r = 0; r < ROWS; r++) {
+                int32_t a = a_pairs[r * K_PAIRS + kp];
+                int32_t a0 = (int16_t)(a & 0xFFFF);
+                int32_t a1 = (int16_t)(a >> 16);
+                for (int j = 0; j < CPU_PANEL; j++) {
+                    acc[r][j] += a0 * w[2 * j] + a1 * w[2 * j + 1];
+                }
+            }
+        }
+#endif
+        for (int r = 0; r < ROWS; r++) {
+            for (int j = 0; j < CPU_PANEL; j++) {
+                total[r][j] += acc[r][j];
+            }
+        }
+    }
+    for (int r = 0; r < ROWS; r++) {
+        for (int j = 0; j < cols; j++) {
+            out[r * out_stride + j] = wgt_fmt::finish(total[r][j]);
+        }
+    }
+}
+
+void cpu_gemm(
+    const aligned_vector<int8_t>& act,
+    const CpuWeights& wgt,
+    int32_t* out, int out_stride,
+    int M
+) {
+    const int K = wgt.K;
+    const int N = wgt.N;
+    const int K_STRIDE = act_row_stride(K);
+    const int K_PAIRS = num_tiles(K, 2);
+    const int NUM_PANELS = num_tiles(N, CPU_PANEL);
+    
+    // Activations as sign-extended (k, k+1) int16 pairs, ready to broadcast
+    aligned_vector<int32_t> a_pairs((size_t)M * K_PAIRS);
+    for (int m = 0; m < M; m++) {
+        for (int kp = 0; kp < K_PAIRS; kp++) {
+            int k = 2 * kp;
+            int16_t a0 = act[m * K_STRIDE + k];
+            int16_t a1 = (k + 1 < K) ? act[m * K_STRIDE + k + 1] : 0;
+            a_pairs[(size_t)m * K_PAIRS + kp] = (int32_t)(uint16_t)a0 | ((int32_t)a1 << 16);
+        }
+    }
+    
+    parallel_for(NUM_PANELS, 1, [&](int begin, int end) {
+        for (int p = begin; p < end; p++) {
+            const int16_t* panel = &wgt.panels[(size_t)p * K_PAIRS * CPU_PANEL * 2];
+            const int n0 = p * CPU_PANEL;
+            const int cols = std::min(CPU_PANEL, N - n0);
+            
+            int m = 0;
+            for (; m + CPU_ROWS <= M; m += CPU_ROWS) {
+                gemm_block<CPU_ROWS>(&a_pairs[(size_t)m * K_PAIRS], K_PAIRS, panel,
+                                     &out[(size_t)m * out_stride + n0], out_stride, cols);
+            }
+            for (; m < M; m++) {
+                gemm_block<1>(&a_pairs[(size_t)m * K_PAIRS], K_PAIRS, panel,
+                              &out[(size_t)m * out_stride + n0], out_stride, cols);
+            }
+        }
+    });
+}
+
+void cpu_reference(
+    const aligned_vector<int8_t>& act,
+    const aligned_vector<uint8_t>& wgt_packed,
+    const aligned_vector<uint8_t>& scales,
+    aligned_vector<int32_t>& out,
+    int M, int K, int N
+) {
+    CpuWeights wgt;
+    prepare_cpu_weights(wgt_packed, scales, wgt, K, N);
+    out.assign((size_t)M * N, 0);
+    cpu_gemm(act, wgt, out.data(), N, M);
+}
+
+EpilogueParams make_epilogue(
+    int epi,
+    const std::vector<int32_t>& bias,
+    const std::vector<float>& scale,
+    const std::vector<int8_t>& lut
+) {
+    const int N = (int)bias.size();
+    if (epi < EPI_REQUANT || epi > EPI_LUT || N < 1 || N > EPI_MAX_N || (int)scale.size() != N) {
+        throw std::invalid_argument("make_epilogue: needs an EPI_* mode and 1 <= N <= EPI_MAX_N biases and scales");
+    }
+    if (epi == EPI_LUT && lut.size() != 256) {
+        throw std::invalid_argument("make_epilogue: EPI_LUT needs a 256-entry table");
+    }
+
+    EpilogueParams p;
+    p.epi = epi;
+    p.N = N;
+    p.words.assign((size_t)epi_words(N) * PE_COLS, 0);
+
+    if (epi == EPI_LUT) {
+        for (int e = 0; e < 256; e++) {
+            p.words[e / 4] |= (int32_t)((uint32_t)(uint8_t)lut[e] << (8 * (e % 4)));
+        }
+    }
+
+    // scale = mult / 2^shift with mult in [2^14, 2^15) where the shift range
+    // allows; padding columns keep mult = 0
+    for (int n = 0; n < N; n++) {
+        if (!(scale[n] > 0.0f) || !std::isfinite(scale[n])) {
+            throw std::invalid_argument("make_epilogue: scales must be positive and finite");
+        }
+        int e;
+        std::frexp(scale[n], &e);
+        int shift = std::max(0, std::min(EPI_MAX_SHIFT, 15 - e));
+        int64_t mult = std::llround(std::ldexp((double)scale[n], shift));
+        if (mult >= (1 << 15)) {
+            if (shift > 0) {
+                shift--;
+                mult = std::llround(std::ldexp((double)scale[n], shift));
+            }
+            mult = std::min<int64_t>(mult, (1 << 15) - 1);
+        }
+        const size_t base = (size_t)(EPI_LUT_WORDS + 2 * (n / PE_COLS)) * PE_COLS + n % PE_COLS;
+        p.words[base] = bias[n];
+        p.words[base + PE_COLS] = (shift << 16) | (int32_t)mult;
+    }
+    return p;
+}
+
+std::vector<int8_t> gelu_lut(float in_scale, float out_scale) {
+    std::vector<int8_t> lut(256);
+    for (int q = -128; q < 128; q++) {
+        const double x = q * (double)in_scale;
+        const double y = 0.5 * x * (1.0 + std::erf(x / std::sqrt(2.0)));
+        lut[q + 128] = (int8_t)std::max(-128.0, std::min(127.0, std::nearbyint(y / out_scale)));
+    }
+    return lut;
+}
+
+void apply_epilogue(
+    const int32_t* acc, int acc_stride,
+    const EpilogueParams& params,
+    int8_t* out, int out_stride,
+    int M
+) {
+    int8_t lut[256];
+    for (int e = 0; e < 256; e++) {
+        lut[e] = (int8_t)(params.words[e / 4] >> (8 * (e % 4)));
+    }
+    for (int m = 0; m < M; m++) {
+        for (int n = 0; n < params.N; n++) {
+            const size_t base = (size_t)(EPI_LUT_WORDS + 2 * (n / PE_COLS)) * PE_COLS + n % PE_COLS;
+            out[(size_t)m * out_stride + n] = epilogue_apply(
+                acc[(size_t)m * acc_stride + n], params.words[base], params.words[base + PE_COLS], params.epi, lut);
+        }
+    }
+}
+
+// ============================================================================
+// Buffer pool
+// ============================================================================
+static void lock_pages(const void* p, size_t bytes) {
+    if (bytes) mlock(p, bytes);  // best effort: RLIMIT_MEMLOCK may refuse
+}
+
+static void unlock_pages(const void* p, size_t bytes) {
+    if (bytes) munlock(p, bytes);
+}
+
+BufferPool::~BufferPool() {
+    for (auto& set : sets_) {
+        unlock_pages(set->act.data(), set->act.size());
+        unlock_pages(set->out.data(), set->out.size() * sizeof(int32_t));
+    }
+}
+
+KernelBuffers* BufferPool::acquire(int M, int K, int N) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = free_.begin(); it != free_.end(); ++it) {
+        if ((*it)->K == K && (*it)->N == N && (*it)->rows >= M) {
+            KernelBuffers* set = *it;
+            free_.erase(it);
+            return set;
+        }
+    }
+
+    // assign() faults every page in before it is locked
+    auto set = std::make_unique<KernelBuffers>();
+    set->K = K;
+    set->N = N;
+    set->rows = std::max(M, min_rows_);
+    set->act.assign((size_t)set->rows * act_row_stride(K), 0);
+    set->out.assign((size_t)set->rows * out_row_stride(N), 0);
+    lock_pages(set->act.data(), set->act.size());
+    lock_pages(set->out.data(), set->out.size() * sizeof(int32_t));
+    sets_.push_back(std::move(set));
+    return sets_.back().get();
+}
+
+void BufferPool::release(KernelBuffers* buffers) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(buffers);
+}
+
+size_t BufferPool::bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t total = 0;
+    for (const auto& set : sets_) total += set->act.size() + set->out.size() * sizeof(int32_t);
+    return total;
+}
+
+int BufferPool::sets() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return (int)sets_.size();
+}
+
+static thread_local aligned_vector<uint64_t> prof_stats(PROF_WORDS, 0);
+
+const aligned_vector<uint64_t>& kernel_profile() {
+    return prof_stats;
+}
+
+std::string format_profile(const aligned_vector<uint64_t>& stats) {
+    static const char* const PHASES[][PROF_PHASES] = {
+        {"hbm_act", "chain_act", "chain_rows", nullptr},          // LoadAct
+        {"recv_act", "recv_wgt", "mac", "write_output"},           // Compute
+        {"load_params", "apply", nullptr, nullptr},                // Epilogue
+        {"store", nullptr, nullptr, nullptr},                      // StoreResult
+        {"store", nullptr, nullptr, nullptr},                      // StoreQ8
+        {"load_wgt", nullptr, nullptr, nullptr},                   // LoadWgt
+    };
+    static const char* const TASKS[] = {"LoadAct", "Compute", "Epilogue", "StoreResult", "StoreQ8", "LoadWgt"};
+
+    if (stats.size() < (size_t)PROF_WORDS || stats[1] != (uint64_t)PROF_TASKS) {
+        return "no kernel profile (build with PROFILE=1)\n";
+    }
+    const uint64_t total = stats[0];
+    std::string out;
+    char line[160];
+    std::snprintf(line, sizeof(line), "%-22s %14s %14s %14s %7s\n", "task/phase", "cycles", "iterations", "stalls", "%call");
+    out += line;
+    for (int t = 0; t < PROF_TASKS; t++) {
+        const int kind = (t < PROF_LOAD_WGT) ? t : PROF_LOAD_WGT;
+        for (int p = 0; p < PROF_PHASES; p++) {
+            const uint64_t cycles = stats[prof_index(t, p)];
+            const uint64_t iters = stats[prof_index(t, p) + 1];
+            if (!PHASES[kind][p] || (cycles == 0 && iters == 0)) continue;
+            std::string name = std::string(TASKS[kind]) + (kind == PROF_LOAD_WGT ? std::to_string(t - PROF_LOAD_WGT) : "")
+                             + "/" + PHASES[kind][p];
+            std::snprintf(line, sizeof(line), "%-22s %14llu %14llu %14llu %6.1f%%\n", name.c_str(),
+                          (unsigned long long)cycles, (unsigned long long)iters,
+                          (unsigned long long)(cycles > iters ? cycles - iters : 0),
+                          total ? 100.0 * cycles / total : 0.0);
+            out += line;
+        }
+    }
+    std::snprintf(line, sizeof(line), "%-22s %14llu\n", "call", (unsigned long long)total);
+    out += line;
+    return out;
+}
+
+// ============================================================================
+// Kernel model (MODEL_BITSTREAM)
+//
+// The same call as SystolicArrayKernel, on the host: weights are decoded
+// from the HBM shards exactly as LoadWgt and Compute see them
+// (wgt_col_offset / scale_col_offset, wgt_fmt::dequant); on the array path
+// of a block-sparse build, blocks missing from a tile's index are zero, as
+// the kernel never loads them. The products run through cpu_gemm (exact
+// sums, rounded once by wgt_fmt::finish like C_work, C_acc and ReduceK),
+// and the epilogue through apply_epilogue. W_cache and A_chain are state
+// of the model as they are of the kernel: CMD_LOAD_WGT parks the decoded
+// weights for CMD_COMPUTE, CHAIN_OUT keeps the int8 result for CHAIN_IN.
+// Profile counters stay zero.
+// ============================================================================
+static std::mutex model_mutex;       // guards the two below
+static CpuWeights model_wgt_cache;   // W_cache
+static aligned_vector<int8_t> model_chain;  // A_chain, M x act_row_stride(N)
+
+static void model_weights(const WeightView& wgt, CpuWeights& out, int M, int K, int N, int cmd) {
+#if SA_WGT_SPARSE
+    // Nonzero blocks of every N-tile, from the shards' block index
+    const bool SPARSE_PATH = !use_gemv(cmd, M, N) && !use_ksplit(cmd, M, K, N);
+    std::vector<uint8_t> present((size_t)num_tiles(N, PE_COLS) * sparse_blocks(K), !SPARSE_PATH);
+    for (int t = 0; SPARSE_PATH && t < num_tiles(N, PE_COLS); t++) {
+        const uint8_t* index = wgt.packed[t % WGT_CHANNELS] + (size_t)sparse_index_word(K, N, t / WGT_CHANNELS) * AXI_BYTES;
+        const int count = index[0] | (index[1] << 8);
+        for (int b = 1; b <= count; b++) {
+            const int blk = index[2 * b] | (index[2 * b + 1] << 8);
+            if (blk < sparse_blocks(K)) present[(size_t)t * sparse_blocks(K) + blk] = 1;
+        }
+    }
+#else
+    (void)M; (void)cmd;  // only pick the sparse path
+#endif
+    fill_panels(out, K, N, [&](int k, int n) -> wgt_t {
+        const int t = n / PE_COLS;
+        const int j = n % PE_COLS;
+#if SA_WGT_SPARSE
+        if (!present[(size_t)t * sparse_blocks(K) + k / SPARSE_BLOCK]) return 0;
+#endif
+        const uint8_t* w = wgt.packed[t % WGT_CHANNELS];
+        const uint8_t* s = wgt.scales[t % WGT_CHANNELS];
+        return wgt_fmt::dequant(w[wgt_col_offset(K, N, k, t / WGT_CHANNELS) + j / 2], j & 1,
+                                s[scale_col_offset(K, N, k, t / WGT_CHANNELS) + wgt_fmt::lane_scale(j)]);
+    });
+}
+
+static int64_t run_kernel_model(
+    const aligned_vector<int8_t>& act,
+    const WeightView& wgt,
+    int epi,
+    const int32_t* epi_words, size_t epi_count,
+    int32_t* out, int8_t* out_q8,
+    int M, int K, int N, int cmd, int chain
+) {
+    auto t0 = std::chrono::steady_clock::now();
+    auto elapsed = [&] {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+    };
+    std::fill(prof_stats.begin(), prof_stats.end(), 0);
+
+    CpuWeights streamed;
+    if (cmd != CMD_COMPUTE) model_weights(wgt, streamed, M, K, N, cmd);
+
+    std::unique_lock<std::mutex> lock(model_mutex);
+    if (cmd == CMD_LOAD_WGT) {
+        model_wgt_cache = std::move(streamed);
+        return elapsed();
+    }
+    if (cmd == CMD_COMPUTE) {
+        if (model_wgt_cache.K != K || model_wgt_cache.N != N) {
+            throw std::runtime_error("kernel model: CMD_COMPUTE needs weights parked by CMD_LOAD_WGT with this K and N");
+        }
+    } else if (!use_gemv(cmd, M, N) && !use_ksplit(cmd, M, K, N)) {
+        model_wgt_cache = CpuWeights();  // a streamed call on the array overwrites W_cache
+    }
+    const CpuWeights& w = (cmd == CMD_COMPUTE) ? model_wgt_cache : streamed;
+    // Unchained CMD_RUN calls touch no more state and may run concurrently
+    if (cmd == CMD_RUN && chain == 0) lock.unlock();
+
+    const aligned_vector<int8_t>* in = &act;
+    aligned_vector<int8_t> rounded;
+    if (use_chain_in(cmd, M, chain)) {
+        if (model_chain.size() != (size_t)M * act_row_stride(K)) {
+            throw std::runtime_error("kernel model: CHAIN_IN without a chained M x K result");
+        }
+        in = &model_chain;
+    } else if (SA_ACT_INT4) {
+        // The kernel sees the activations as the compressed port carries them
+        rounded.assign(act.begin(), act.begin() + (size_t)M * act_row_stride(K));
+        round_activations(rounded.data(), M, K, act_row_stride(K));
+        in = &rounded;
+    }
+
+    const int OUT_STRIDE = out_row_stride(N);
+    aligned_vector<int32_t> acc;
+    int32_t* sums = out;
+    if (epi != EPI_OFF) {
+        acc.assign((size_t)M * OUT_STRIDE, 0);
+        sums = acc.data();
+    }
+    cpu_gemm(*in, w, sums, OUT_STRIDE, M);
+    for (int m = 0; m < M; m++) {
+        std::fill(sums + (size_t)m * OUT_STRIDE + N, sums + (size_t)(m + 1) * OUT_STRIDE, 0);  // pad columns
+    }
+
+    if (epi != EPI_OFF) {
+        EpilogueParams params;
+        params.epi = epi;
+        params.N = N;
+        params.words.assign(epi_words, epi_words + epi_count);
+        if (use_chain_out(cmd, M, N, epi, chain)) {
+            aligned_vector<int8_t> next((size_t)M * act_row_stride(N), 0);
+            apply_epilogue(sums, OUT_STRIDE, params, next.data(), act_row_stride(N), M);
+            model_chain.swap(next);
+        } else {
+            apply_epilogue(sums, OUT_STRIDE, params, out_q8, OUT_STRIDE, M);
+        }
+    }
+    return elapsed();
+}
+
+// Every port is always bound, but only the regions a call actually reads
+// or writes cross PCIe: the M rows of activations and results (not the
+// whole buffer), the weights unless CMD_COMPUTE finds them parked in
+// W_cache, and the epilogue words only with an epilogue. Ports the call
+// leaves alone are placeholder mmaps, allocated on the device but never
+// copied. Each combination is its own tapa::invoke instantiation.
+template <typename WgtPorts, typename ActPort, typename EpiPort, typename OutPort, typename Q8Port>
+static int64_t launch_kernel(
+    const std::string& bitstream,
+    const WeightView& wgt,
+    ActPort act_port, EpiPort epi_port, OutPort out_port, Q8Port q8_port,
+    int M, int K, int N, int cmd, int epi, int chain
+) {
+    // The kernel only reads the weight ports, so handing TAPA the const
+    // buffers (possibly a read-only file mapping) is safe
+    WgtPorts packed;
+    WgtPorts scales;
+    typedef typename std::decay<decltype(packed[0])>::type WgtPort;
+    for (int c = 0; c < WGT_CHANNELS; c++) {
+        packed[c] = WgtPort(const_cast<uint8_t*>(wgt.packed[c]), wgt.packed_bytes);
+        scales[c] = WgtPort(const_cast<uint8_t*>(wgt.scales[c]), wgt.scale_bytes);
+    }
+
+    return tapa::invoke(
+        SystolicArrayKernel,
+        bitstream,
+        act_port.template vectorized<AXI_BYTES>(),
+        packed.template vectorized<AXI_BYTES>(),
+        scales.template vectorized<AXI_BYTES>(),
+        epi_port.template vectorized<PE_COLS>(),
+        out_port.template vectorized<PE_COLS>(),
+        q8_port.template vectorized<PE_COLS>(),
+        M, K, N, cmd, epi, chain,
+        tapa::write_only_mmap<uint64_t>(prof_stats)
+    );
+}
+
+static int64_t invoke_kernel_impl(
+    const std::string& bitstream,
+    aligned_vector<int8_t>& act,
+    const WeightView& wgt,
+    int epi,
+    const int32_t* epi_words, size_t epi_count,
+    int32_t* out, size_t out_count,
+    int8_t* out_q8, size_t out_q8_count,
+    int M, int K, int N, int cmd, int chain
+) {
+    if (bitstream == MODEL_BITSTREAM) {
+        return run_kernel_model(act, wgt, epi, epi_words, epi_count, out, out_q8, M, K, N, cmd, chain);
+    }
+
+    const bool READS_ACT = cmd != CMD_LOAD_WGT && !use_chain_in(cmd, M, chain);
+    const bool WRITES_OUT = cmd != CMD_LOAD_WGT && epi == EPI_OFF;
+    const bool WRITES_Q8 = cmd != CMD_LOAD_WGT && epi != EPI_OFF && !use_chain_out(cmd, M, N, epi, chain);
+    const size_t ACT_BYTES = (size_t)M * act_row_stride(K);
+    const size_t OUT_WORDS = (size_t)M * out_row_stride(N);
+    if ((READS_ACT && act.size() < ACT_BYTES) || (WRITES_OUT && out_count < OUT_WORDS) ||
+        (WRITES_Q8 && out_q8_count < OUT_WORDS)) {
+        throw std::invalid_argument("invoke_kernel: buffers smaller than an M x K x N call");
+    }
+
+    // Untouched ports keep their full (placeholder) extent
+    int8_t* act_ptr = act.data();
+    size_t act_count = READS_ACT ? ACT_BYTES : act.size();
+#if SA_ACT_INT4
+    // What crosses PCIe and HBM is the compressed form
+    static thread_local aligned_vector<int8_t> act_port;
+    if (READS_ACT) {
+        compress_activations(act.data(), M, K, act_port);
+        act_ptr = act_port.data();
+        act_count = act_port.size();
+    }
+#endif
+    if (WRITES_OUT) out_count = OUT_WORDS;
+    if (WRITES_Q8) out_q8_count = OUT_WORDS;
+    int32_t* epi_ptr = const_cast<int32_t*>(epi_words);
+
+    auto launch = [&](auto wgt_tag, auto act_port) {
+        typedef typename decltype(wgt_tag)::type WgtPorts;
+        if (WRITES_OUT) {
+            return launch_kernel<WgtPorts>(
+                bitstream, wgt, act_port,
+                tapa::placeholder_mmap<int32_t>(epi_ptr, epi_count),
+                tapa::write_only_mmap<int32_t>(out, out_count),
+                tapa::placeholder_mmap<int8_t>(out_q8, out_q8_count), M, K, N, cmd, epi, chain);
+        }
+        if (WRITES_Q8) {
+            return launch_kernel<WgtPorts>(
+                bitstream, wgt, act_port,
+                tapa::read_only_mmap<int32_t>(epi_ptr, epi_count),
+                tapa::placeholder_mmap<int32_t>(out, out_count),
+                tapa::write_only_mmap<int8_t>(out_q8, out_q8_count), M, K, N, cmd, epi, chain);
+        }
+        // CMD_LOAD_WGT, or a CHAIN_OUT call whose result stays on chip
+        if (cmd == CMD_LOAD_WGT) {
+            return launch_kernel<WgtPorts>(
+                bitstream, wgt, act_port,
+                tapa::placeholder_mmap<int32_t>(epi_ptr, epi_count),
+                tapa::placeholder_mmap<int32_t>(out, out_count),
+                tapa::placeholder_mmap<int8_t>(out_q8, out_q8_count), M, K, N, cmd, epi, chain);
+        }
+        return launch_kernel<WgtPorts>(
+            bitstream, wgt, act_port,
+            tapa::read_only_mmap<int32_t>(epi_ptr, epi_count),
+            tapa::placeholder_mmap<int32_t>(out, out_count),
+            tapa::placeholder_mmap<int8_t>(out_q8, out_q8_count), M, K, N, cmd, epi, chain);
+    };
+    struct streamed { typedef tapa::read_only_mmaps<uint8_t, WGT_CHANNELS> type; };
+    struct resident { typedef tapa::placeholder_mmaps<uint8_t, WGT_CHANNELS> type; };
+
+    if (cmd == CMD_COMPUTE) {
+        if (READS_ACT) return launch(resident(), tapa::read_only_mmap<int8_t>(act_ptr, act_count));
+        return launch(resident(), tapa::placeholder_mmap<int8_t>(act_ptr, act_count));
+    }
+    if (READS_ACT) return launch(streamed(), tapa::read_only_mmap<int8_t>(act_ptr, act_count));
+    return launch(streamed(), tapa::placeholder_mmap<int8_t>(act_ptr, act_count));
+}
+
+int64_t invoke_kernel(
+    const std::string& bitstream,
+    aligned_vector<int8_t>& act,
+    const WeightView& wgt,
+    aligned_vector<int32_t>& out,
+    int M, int K, int N, int cmd
+) {
+    static aligned_vector<int32_t> no_epi(PE_COLS, 0);
+    static aligned_vector<int8_t> no_q8(PE_COLS, 0);
+    return invoke_kernel_impl(bitstream, act, wgt, EPI_OFF, no_epi.data(), no_epi.size(),
+                              out.data(), out.size(), no_q8.data(), no_q8.size(), M, K, N, cmd, 0);
+}
+
+int64_t invoke_kernel(
+    const std::string& bitstream,
+    aligned_vector<int8_t>& act,
+    const WeightView& wgt,
+    const EpilogueParams& epi,
+    aligned_vector<int8_t>& out,
+    int M, int K, int N, int cmd, int chain
+) {
+    if (epi.epi == EPI_OFF || epi.N != N) {
+        throw std::invalid_argument("invoke_kernel: epilogue parameters must be made for this N");
+    }
+    static aligned_vector<int32_t> no_out(PE_COLS, 0);
+    return invoke_kernel_impl(bitstream, act, wgt, epi.epi, epi.words.data(), epi.words.size(),
+                              no_out.data(), no_out.size(), out.data(), out.size(), M, K, N, cmd, chain);
+}
@@ -0,0 +1,245 @@
+#ifndef HOST_H_
+#define HOST_H_
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "sa.h"
+
+// ============================================================================
+// Host-side helpers shared by the test driver and SystolicSession: weight
+// quantization, HBM sharding, the CPU reference and kernel invocation.
+// ============================================================================
+
+template <typename T>
+using aligned_vector = std::vector<T, tapa::aligned_allocator<T>>;
+
+typedef std::array<aligned_vector<uint8_t>, WGT_CHANNELS> shard_array_t;
+
+// Per-channel weight/scale buffers exactly as the kernel reads them. Points
+// into a shard_array_t pair or straight into a mapped weight file.
+struct WeightView {
+    std::array<const uint8_t*, WGT_CHANNELS> packed{};
+    std::array<const uint8_t*, WGT_CHANNELS> scales{};
+    size_t packed_bytes = 0;  // per channel
+    size_t scale_bytes = 0;   // per channel
+};
+
+// Where matrix products run: the FPGA kernel, or cpu_gemm when no device
+// is attached
+enum class Backend { FPGA, CPU };
+
+// Quantize weights to MXINT4 with group-wise scaling (multithreaded, AVX2
+// when built with it; bit-identical to quantize_mxint4_reference)
+void quantize_mxint4(
+    const std::vector<float>& weights_fp32,
+    aligned_vector<uint8_t>& weights_packed,
+    aligned_vector<uint8_t>& scales,
+    int K, int N
+);
+
+// Original single-threaded scalar quantizer, kept as the bit-exact spec
+void quantize_mxint4_reference(
+    const std::vector<float>& weights_fp32,
+    aligned_vector<uint8_t>& weights_packed,
+    aligned_vector<uint8_t>& scales,
+    int K, int N
+);
+
+// Quantize a row-major K x N fp32 matrix into the kernel's padded MXINT4
+// layout (rows padded to wgt_row_stride(N), scales padded to whole words)
+void pack_weights(
+    const std::vector<float>& wgt_fp32,
+    aligned_vector<uint8_t>& wgt_packed,
+    aligned_vector<uint8_t>& scales,
+    int K, int N
+);
+
+// ---- Activation format (SA_ACT_INT4, see sa.h) ----
+// Round M x K int8 activations (rows of stride values) to the ones the
+// block-exponent format carries, in place; nothing to do for int8 builds
+void round_activations(int8_t* act, int M, int K, int stride);
+
+// Activation port contents (act_port_bytes(M, K)) for activations in the
+// kernel layout; int4 builds round off-grid values as round_activations
+void compress_activations(const int8_t* act, int M, int K, aligned_vector<int8_t>& port);
+
+// Split the padded MXINT4 matrix into WGT_CHANNELS HBM shards by N-tile
+// (block-sparse builds append each shard's block index)
+void shard_weights(
+    const aligned_vector<uint8_t>& wgt_packed,
+    const aligned_vector<uint8_t>& scales,
+    shard_array_t& wgt_shards,
+    shard_array_t& scale_shards,
+    int K, int N
+);
+
+// Fraction of the SPARSE_BLOCK x PE_COLS weight blocks the kernel loads and
+// multiplies: nonzero blocks in the shards' block index (SA_WGT_SPARSE),
+// else 1
+double weight_density(const WeightView& wgt, int K, int N);
+
+// Copy columns [n_begin, n_begin + n_count) of the padded MXINT4 matrix
+// (n_begin a multiple of PE_COLS) into a padded matrix of their own
+void slice_weights(
+    const aligned_vector<uint8_t>& wgt_packed,
+    const aligned_vector<uint8_t>& scales,
+    int K, int N,
+    int n_begin, int n_count,
+    aligned_vector<uint8_t>& slice_packed,
+    aligned_vector<uint8_t>& slice_scales
+);
+
+// ---- CPU GEMM: test oracle and fallback backend ----
+// Weights dequantized once into int16 K-pair panels (see host.cpp)
+struct CpuWeights {
+    int K = 0;
+    int N = 0;
+    aligned_vector<int16_t> panels;
+};
+
+void prepare_cpu_weights(
+    const aligned_vector<uint8_t>& wgt_packed,
+    const aligned_vector<uint8_t>& scales,
+    CpuWeights& wgt,
+    int K, int N
+);
+
+// out[m * out_stride + n] = sum_k act[m][k] * W[k][n] for activations in the
+// kernel layout (M x act_row_stride(K)); blocked, AVX2, multithreaded
+void cpu_gemm(
+    const aligned_vector<int8_t>& act,
+    const CpuWeights& wgt,
+    int32_t* out, int out_stride,
+    int M
+);
+
+// Inverse of shard_weights: rebuild the padded MXINT4 matrix and scales
+void unshard_weights(
+    const WeightView& wgt,
+    aligned_vector<uint8_t>& wgt_packed,
+    aligned_vector<uint8_t>& scales,
+    int K, int N
+);
+
+WeightView view_shards(const shard_array_t& wgt_shards, const shard_array_t& scale_shards);
+
+// CPU reference with MXINT4 dequantization (kernel's padded row layout)
+void cpu_reference(
+    const aligned_vector<int8_t>& act,
+    const aligned_vector<uint8_t>& wgt_packed,
+    const aligned_vector<uint8_t>& scales,
+    aligned_vector<int32_t>& out,
+    int M, int K, int N
+);
+
+// ---- Fused epilogue (see EPI_* in sa.h) ----
+// Parameters of one layer in the layout of the kernel's epilogue port
+struct EpilogueParams {
+    int epi = EPI_OFF;
+    int N = 0;
+    aligned_vector<int32_t> words;  // epi_words(N) x PE_COLS
+};
+
+// out[n] = act(clamp(round((acc[n] + bias[n]) * scale[n]))) with scale[n] > 0
+// turned into a 15-bit multiplier and a shift; lut (256 entries, indexed by
+// q + 128) is only used by EPI_LUT
+EpilogueParams make_epilogue(
+    int epi,
+    const std::vector<int32_t>& bias,
+    const std::vector<float>& scale,
+    const std::vector<int8_t>& lut = {}
+);
+
+// Table for EPI_LUT: int8 GELU with inputs in units of in_scale and outputs
+// in units of out_scale
+std::vector<int8_t> gelu_lut(float in_scale, float out_scale);
+
+// Bit-exact host model of the epilogue on int32 results
+void apply_epilogue(
+    const int32_t* acc, int acc_stride,
+    const EpilogueParams& params,
+    int8_t* out, int out_stride,
+    int M
+);
+
+// Bitstream naming the kernel's host model (--backend=model): invoke_kernel
+// then runs a bit-accurate, multithreaded functional model of the call on
+// the same buffers and commands, in place of TAPA software simulation
+const std::string MODEL_BITSTREAM = "model";
+
+// One SystolicArrayKernel call on host buffers in the kernel layout
+// (activations M x act_row_stride(K), out M x out_row_stride(N)).
+// Returns the kernel time in nanoseconds.
+int64_t invoke_kernel(
+    const std::string& bitstream,
+    aligned_vector<int8_t>& act,
+    const WeightView& wgt,
+    aligned_vector<int32_t>& out,
+    int M, int K, int N, int cmd
+);
+
+// ---- Host buffer pool ----
+// Kernel-layout activation and result buffers of one layer shape
+struct KernelBuffers {
+    int K = 0;
+    int N = 0;
+    int rows = 0;                 // capacity in M
+    aligned_vector<int8_t> act;   // rows x act_row_stride(K), pad columns zero
+    aligned_vector<int32_t> out;  // rows x out_row_stride(N)
+};
+
+// Page-aligned KernelBuffers kept per (K, N) and handed out again after
+// release(). A set is allocated for at least min_rows rows, faulted in and
+// locked in memory (mlock, best effort) once, so steady-state calls neither
+// allocate nor page; invoke_kernel then moves only the rows a call uses.
+// Thread-safe.
+class BufferPool {
+ public:
+    explicit BufferPool(int min_rows = M_DIM) : min_rows_(min_rows) {}
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // A free set for K x N with room for M rows. The caller writes the
+    // first M activation rows (columns [0, K) only) and releases the set
+    // when it has read the results.
+    KernelBuffers* acquire(int M, int K, int N);
+    void release(KernelBuffers* buffers);
+
+    size_t bytes() const;  // held in all sets
+    int sets() const;
+
+ private:
+    const int min_rows_;
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<KernelBuffers>> sets_;
+    std::vector<KernelBuffers*> free_;
+};
+
+// ---- Profiling (make PROFILE=1) ----
+// PROF_WORDS counters of the calling thread's last kernel call (all zero
+// unless the kernel is built with SA_PROFILE)
+const aligned_vector<uint64_t>& kernel_profile();
+
+// Table of the counters: cycles, iterations and stall cycles per task phase
+std::string format_profile(const aligned_vector<uint64_t>& stats);
+
+// Same with the epilogue enabled: out gets M x out_row_stride(N) int8
+// (nothing with CHAIN_OUT in chain; see LayerChain)
+int64_t invoke_kernel(
+    const std::string& bitstream,
+    aligned_vector<int8_t>& act,
+    const WeightView& wgt,
+    const EpilogueParams& epi,
+    aligned_vector<int8_t>& out,
+    int M, int K, int N, int cmd,
+    int chain = 0
+);
+
+#endif
@@ -1,120 +1,388 @@
+#include <array>
 #include <iostream>
 #include <vector>
 #include <cstdint>
+#include <memory>
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <random>
+#include <thread>
 #include <gflags/gflags.h>
 
-#include "sa.h"
+#include "bench.h"
+#include "chain.h"
+#include "host.h"
+#include "replicas.h"
+#include "session.h"
+#include "weight_file.h"
 
 using std::cout;
 using std::endl;
 using std::vector;
 
 DEFINE_string(bitstream, "", "path to bitstream");
+DEFINE_string(backend, "fpga", "fpga: run SystolicArrayKernel, model: its bit-accurate host model, cpu: run the CPU GEMM fallback");
+DEFINE_int32(m, M_DIM, "M dimension (rows of activations / output)");
+DEFINE_int32(k, K_DIM, "K dimension (reduction, at most K_MAX)");
+DEFINE_int32(n, N_DIM, "N dimension (columns of weights / output)");
+DEFINE_bool(gemv, false, "GEMV decode mode (forces M=1)");
+DEFINE_int32(stationary, 0, "weight-stationary mode: load weights once, then run this many compute calls");
+DEFINE_bool(quant_bench, false, "benchmark quantize_mxint4 on a K x N matrix against the scalar reference");
+DEFINE_int32(session, 0, "submit this many M-row requests through SystolicSession (batched)");
+DEFINE_int32(streams, 1, "--session: kernel calls in flight at once");
+DEFINE_double(qps, 0.0, "--session: Poisson arrival rate of the load generator in requests/s (0: submit all at once)");
+DEFINE_string(save_weights, "", "write the quantized, sharded weights to this file");
+DEFINE_int32(replicas, 1, "split N over this many kernel replicas (compute units of a REPLICAS build)");
+DEFINE_string(epilogue, "", "fused int8 epilogue: requant, relu or gelu (default: int32 results)");
+DEFINE_int32(chain, 0, "run this many chained layers (K x N, N x K, ...) with on-chip intermediates");
+DEFINE_string(bench, "", "benchmark these MxKxN shapes, e.g. 64x256x512,1x4096x14336");
+DEFINE_int32(warmup, 2, "--bench: untimed calls per shape");
+DEFINE_int32(iters, 10, "--bench: timed calls per shape");
+DEFINE_double(clock_mhz, 300.0, "--bench: kernel clock for the peak GOPS");
+DEFINE_double(hbm_gbps, 0.0, "--bench: HBM bandwidth for the roofline (0: the kernel's bound pseudo-channels)");
+DEFINE_string(bench_csv, "", "--bench: also write the results to this CSV file");
+DEFINE_string(bench_json, "", "--bench: also write the results to this JSON file");
+DEFINE_double(sparsity, 0.0, "prune this fraction of the SPARSE_BLOCK x PE_COLS weight blocks to zero");
+DEFINE_string(load_weights, "", "map pre-quantized weights from this file (sets K and N) instead of quantizing");
 
-const int M = M_DIM;
-const int K = K_DIM;
-const int N = N_DIM;
-
-template <typename T>
-using aligned_vector = std::vector<T, tapa::aligned_allocator<T>>;
+// Time the fast quantizer against the scalar reference on a K x N matrix
+// with a wide dynamic range and check the outputs are bit-identical
+int run_quant_bench(int K, int N) {
+    const int64_t total = (int64_t)K * N;
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> mant(-1.0f, 1.0f);
+    std::uniform_int_distribution<int> expo(-6, 9);
+    vector<float> wgt(total);
+    for (int64_t i = 0; i < total; i++) {
+        wgt[i] = std::ldexp(mant(rng), expo(rng));
+    }
+    // Exact halves and values around the shift thresholds
+    for (int64_t i = 0; i < std::min<int64_t>(total, 4096); i++) {
+        float edge = std::ldexp(1.0f, 4 + (int)(i % 3));
+        wgt[i * 97 % total] = (i % 2) ? std::nextafter(edge, 0.0f) : (i % 5) * 0.5f * (1 << 2 * (i % 4));
+    }
+    
+    auto time_ms = [](auto&& fn) {
+        auto t0 = std::chrono::steady_clock::now();
+        fn();
+        auto t1 = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::milli>(t1 - t0).count();
+    };
+    
+    aligned_vector<uint8_t> ref_packed, ref_scales, fast_packed, fast_scales;
+    double ref_ms = time_ms([&] { quantize_mxint4_reference(wgt, ref_packed, ref_scales, K, N); });
+    quantize_mxint4(wgt, fast_packed, fast_scales, K, N);  // warm up threads and pages
+    double fast_ms = time_ms([&] { quantize_mxint4(wgt, fast_packed, fast_scales, K, N); });
+    
+    const double gbytes = total * sizeof(float) / 1e9;
+    cout << "quantize_mxint4 on " << K << " x " << N << " (" << gbytes * 1e3 << " MB fp32)" << endl;
+    cout << "  reference: " << ref_ms << " ms, " << gbytes / (ref_ms / 1e3) << " GB/s" << endl;
+    cout << "  fast:      " << fast_ms << " ms, " << gbytes / (fast_ms / 1e3) << " GB/s ("
+         << ref_ms / fast_ms << "x)" << endl;
+    
+    bool same = ref_packed == fast_packed && ref_scales == fast_scales;
+    cout << (same ? "Bit-identical: PASS!" : "Bit-identical: FAIL!") << endl;
+    return same ? 0 : 1;
+}
 
-// Quantize weights to MXINT4 with group-wise scaling
-void quantize_mxint4(
-    const vector<float>& weights_fp32,
-    aligned_vector<uint8_t>& weights_packed,
-    aligned_vector<uint8_t>& scales,
-    int K, int N
+// Push FLAGS_session requests of M rows each through a SystolicSession and
+// check every result against the CPU reference. A generator thread submits
+// them at FLAGS_qps (exponential gaps) while this thread collects results in
+// order; the sustained rate is requests over first submit to last result.
+int run_session(
+    Backend backend,
+    const aligned_vector<uint8_t>& wgt_packed,
+    const aligned_vector<uint8_t>& scales,
+    int M, int K, int N
 ) {
-    int total_weights = K * N;
-    weights_packed.resize(total_weights / 2);
-    scales.resize(total_weights / GROUP_SIZE);
+    using clock = std::chrono::steady_clock;
+    const int K_STRIDE = act_row_stride(K);
+    const int R = FLAGS_session;
+    SystolicSession session(FLAGS_bitstream, backend, std::chrono::microseconds(200), FLAGS_streams);
+    const int layer = session.add_layer(wgt_packed, scales, K, N);
     
-    // Process each group
-    for (int grp = 0; grp < total_weights / GROUP_SIZE; grp++) {
-        int base_idx = grp * GROUP_SIZE;
-        
-        // Find max absolute value in group
-        float max_abs = 0.0f;
-        for (int i = 0; i < GROUP_SIZE; i++) {
-            max_abs = std::max(max_abs, std::fabs(weights_fp32[base_idx + i]));
+    // Each request gets its own activations
+    vector<vector<int8_t>> acts(R, vector<int8_t>(M * K));
+    for (int r = 0; r < R; r++) {
+        for (int i = 0; i < M * K; i++) {
+            acts[r][i] = (int8_t)(((i + 5 * r) % 17) - 8) * 15;
         }
-        
-        // Compute scale (shift amount for 4-bit range)
-        int shift = 0;
-        if (max_abs > 0.0f) {
-            shift = (int)std::floor(std::log2(max_abs)) - 3;
-            shift = std::max(0, std::min(3, shift));  // Limit to [0, 3] -> shift by 0,2,4,6
+        round_activations(acts[r].data(), M, K, K);
+    }
+    
+    vector<std::future<vector<int32_t>>> results(R);
+    vector<clock::time_point> submitted(R);
+    std::mutex mutex;
+    std::condition_variable cv;
+    int n_submitted = 0;
+
+    const clock::time_point t0 = clock::now();
+    std::thread generator([&] {
+        std::mt19937 rng(42);
+        std::exponential_distribution<double> gap(FLAGS_qps > 0 ? FLAGS_qps : 1.0);
+        clock::time_point next = t0;
+        for (int r = 0; r < R; r++) {
+            if (FLAGS_qps > 0) {
+                std::this_thread::sleep_until(next);
+                next += std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(gap(rng)));
+            }
+            std::future<vector<int32_t>> f = session.submit(acts[r], M, layer);
+            std::lock_guard<std::mutex> lock(mutex);
+            submitted[r] = clock::now();
+            results[r] = std::move(f);
+            n_submitted++;
+            cv.notify_one();
         }
-        
-        // Store scale (only Sw[1:0] used for now)
-        scales[grp] = (uint8_t)shift;
-        
-        // Quantize weights in group
-        float scale_val = std::pow(2.0f, shift * 2);  // shift * 2 because Sw[1:0]*2
-        
-        for (int i = 0; i < GROUP_SIZE; i += 2) {
-            int idx0 = base_idx + i;
-            int idx1 = base_idx + i + 1;
-            
-            // Quantize to 4-bit
-            int8_t w0 = (int8_t)std::round(weights_fp32[idx0] / scale_val);
-            int8_t w1 = (int8_t)std::round(weights_fp32[idx1] / scale_val);
-            
-            // Clamp to 4-bit signed range [-8, 7]
-            w0 = std::max((int8_t)-8, std::min((int8_t)7, w0));
-            w1 = std::max((int8_t)-8, std::min((int8_t)7, w1));
-            
-            // Pack: lower 4 bits = w0, upper 4 bits = w1
-            uint8_t packed = (w0 & 0x0F) | ((w1 & 0x0F) << 4);
-            weights_packed[idx0 / 2] = packed;
+    });
+
+    vector<vector<int32_t>> outs(R);
+    vector<double> latency_us(R);
+    for (int r = 0; r < R; r++) {
+        std::future<vector<int32_t>> f;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&] { return n_submitted > r; });
+            f = std::move(results[r]);
         }
+        outs[r] = f.get();
+        latency_us[r] = std::chrono::duration<double, std::micro>(clock::now() - submitted[r]).count();
     }
+    const double wall_s = std::chrono::duration<double>(clock::now() - t0).count();
+    generator.join();
+    
+    int errors = 0;
+    for (int r = 0; r < R; r++) {
+        aligned_vector<int8_t> act_pad(M * K_STRIDE, 0);
+        for (int m = 0; m < M; m++) {
+            std::copy_n(&acts[r][m * K], K, &act_pad[m * K_STRIDE]);
+        }
+        aligned_vector<int32_t> out_cpu;
+        cpu_reference(act_pad, wgt_packed, scales, out_cpu, M, K, N);
+        for (int i = 0; i < M * N; i++) {
+            if (outs[r][i] != out_cpu[i]) errors++;
+        }
+    }
+    
+    vector<double> sorted = latency_us;
+    std::sort(sorted.begin(), sorted.end());
+    double mean_us = 0;
+    for (double l : sorted) mean_us += l / R;
+    auto pct = [&](double p) { return sorted[std::min(R - 1, (int)(p * R))]; };
+
+    SystolicSession::Stats st = session.stats();
+    cout << "\nSession: " << st.requests << " requests in " << st.batches << " batches ("
+         << (double)st.rows / st.batches << " rows/batch), "
+         << st.weight_loads << " weight loads, " << st.device_ns / 1e3 << " us on device, "
+         << st.buffer_bytes / 1024 << " KB pooled buffers" << endl;
+    cout << "Load: " << session.streams() << " stream(s), offered "
+         << (FLAGS_qps > 0 ? std::to_string((int64_t)FLAGS_qps) + " req/s" : std::string("all at once"))
+         << ", sustained " << R / wall_s << " req/s, latency mean " << mean_us
+         << " us, p50 " << pct(0.50) << " us, p99 " << pct(0.99) << " us" << endl;
+    cout << "Errors: " << errors << " / " << (int64_t)R * M * N << endl;
+    cout << (errors == 0 ? "PASS!" : "FAIL!") << endl;
+    return errors == 0 ? 0 : 1;
 }
 
-// CPU reference with MXINT4 dequantization
-void cpu_reference(
-    const aligned_vector<int8_t>& act,
-    const aligned_vector<uint8_t>& wgt_packed,
-    const aligned_vector<uint8_t>& scales,
-    aligned_vector<int32_t>& out,
-    int M, int K, int N
-) {
-    out.resize(M * N, 0);
+// Epilogue test parameters: per-column bias and scale around the range of
+// the reference results, GELU inputs in [-4, 4)
+EpilogueParams make_test_epilogue(int epi, const aligned_vector<int32_t>& ref, int N) {
+    int64_t max_abs = 1;
+    for (int32_t v : ref) max_abs = std::max<int64_t>(max_abs, std::abs((int64_t)v));
+    vector<int32_t> bias(N);
+    vector<float> scale(N);
+    for (int n = 0; n < N; n++) {
+        bias[n] = (int32_t)(((n % 7) - 3) * max_abs / 16);
+        scale[n] = 127.0f / max_abs * (1.0f + (n % 5) / 4.0f);
+    }
+    return make_epilogue(epi, bias, scale, epi == EPI_LUT ? gelu_lut(4.0f / 128, 4.0f / 127) : vector<int8_t>());
+}
+
+// Run FLAGS_chain layers of alternating shape K x N and N x K through a
+// LayerChain and check the last int8 result against the layer-by-layer
+// CPU reference
+int run_chain(Backend backend, int epi, int M, int K, int N) {
+    LayerChain chain;
+    aligned_vector<int8_t> act(M * act_row_stride(K), 0);
+    for (int m = 0; m < M; m++) {
+        for (int k = 0; k < K; k++) {
+            act[m * act_row_stride(K) + k] = (int8_t)((((m * K + k) % 17) - 8) * 15);
+        }
+    }
     
+    // Reference, one layer at a time through host memory
+    round_activations(act.data(), M, K, act_row_stride(K));
+    aligned_vector<int8_t> ref_act = act;
+    vector<int8_t> ref_out;
+    int layer_k = K;
+    for (int l = 0; l < FLAGS_chain; l++) {
+        const int layer_n = (l % 2) ? K : N;
+        vector<float> wgt_fp32((size_t)layer_k * layer_n);
+        for (size_t i = 0; i < wgt_fp32.size(); i++) {
+            wgt_fp32[i] = (((i * (l + 1)) % 19) - 9.0f) / 9.0f;
+        }
+        aligned_vector<uint8_t> wgt_packed, scales;
+        pack_weights(wgt_fp32, wgt_packed, scales, layer_k, layer_n);
+        
+        aligned_vector<int32_t> acc;
+        cpu_reference(ref_act, wgt_packed, scales, acc, M, layer_k, layer_n);
+        EpilogueParams params = make_test_epilogue(epi, acc, layer_n);
+        chain.add_layer(wgt_packed, scales, layer_k, layer_n, params);
+        
+        ref_out.assign(M * act_row_stride(layer_n), 0);
+        apply_epilogue(acc.data(), layer_n, params, ref_out.data(), act_row_stride(layer_n), M);
+        ref_act.assign(ref_out.begin(), ref_out.end());
+        layer_k = layer_n;
+    }
+    const int OUT_N = layer_k;
+    
+    vector<int8_t> out(M * act_row_stride(OUT_N), 0);
+    int64_t ns = chain.run(FLAGS_bitstream, backend, act, out.data(), act_row_stride(OUT_N), M);
+    
+    int errors = 0;
     for (int m = 0; m < M; m++) {
-        for (int n = 0; n < N; n++) {
-            int32_t sum = 0;
-            
-            for (int k = 0; k < K; k++) {
-                int8_t a = act[m * K + k];
-                
-                // Get weight
-                int w_idx = k * N + n;
-                int packed_idx = w_idx / 2;
-                uint8_t packed = wgt_packed[packed_idx];
-                
-                // Get scale
-                int scale_idx = w_idx / GROUP_SIZE;
-                uint8_t scale_factor = scales[scale_idx];
-                
-                // Dequantize
-                bool is_upper = (w_idx % 2) == 1;
-                int8_t w = unpack_dequantize_weight(packed, is_upper, scale_factor);
-                
-                sum += (int32_t)a * (int32_t)w;
-            }
-            
-            out[m * N + n] = sum;
+        for (int n = 0; n < OUT_N; n++) {
+            const size_t i = (size_t)m * act_row_stride(OUT_N) + n;
+            if (out[i] != ref_out[i]) errors++;
         }
     }
+    cout << "\nChain: " << chain.layers() << " layers, " << ns / 1e3 << " us, only the last result stored" << endl;
+    cout << "Errors: " << errors << " / " << M * OUT_N << endl;
+    cout << (errors == 0 ? "PASS!" : "FAIL!") << endl;
+    return errors == 0 ? 0 : 1;
+}
+
+// Time every --bench shape and report throughput against the array peak
+// and the HBM roofline
+int run_bench(Backend backend) {
+    BenchOptions opt;
+    opt.warmup = FLAGS_warmup;
+    opt.iters = FLAGS_iters;
+    opt.clock_mhz = FLAGS_clock_mhz;
+    opt.hbm_gbps = FLAGS_hbm_gbps;
+    const vector<BenchShape> shapes = parse_shapes(FLAGS_bench);
+    
+    cout << "Benchmark: " << kernel_config() << ", " << FLAGS_backend
+         << (FLAGS_bitstream.empty() || FLAGS_backend == "model" ? "" : " (" + FLAGS_bitstream + ")") << ", "
+         << opt.warmup << " warmup + " << opt.iters << " timed calls per shape" << endl;
+    cout << "M\tK\tN\tkernel_us\twall_us\txfer_us\tGOPS\tHBM_GB/s\t%peak\tops/B\tbound" << endl;
+    vector<BenchResult> results;
+    for (const BenchShape& shape : shapes) {
+        BenchResult r = run_benchmark(FLAGS_bitstream, backend, shape, opt);
+        cout << shape.M << "\t" << shape.K << "\t" << shape.N << "\t" << r.kernel_us_median << "\t"
+             << r.wall_us_mean << "\t" << r.transfer_us_mean << "\t" << r.gops << "\t" << r.hbm_gbs << "\t"
+             << r.pct_peak << "\t" << r.intensity << "\t" << (r.memory_bound ? "memory" : "compute") << endl;
+        results.push_back(r);
+    }
+    cout << "Peak: " << results[0].peak_gops << " GOPS (" << PE_ROWS << "x" << PE_COLS << " MACs at "
+         << opt.clock_mhz << " MHz)" << endl;
+    if (!FLAGS_bench_csv.empty()) write_bench_csv(FLAGS_bench_csv, FLAGS_bitstream, results);
+    if (!FLAGS_bench_json.empty()) write_bench_json(FLAGS_bench_json, FLAGS_bitstream, results);
+    return 0;
 }
 
 int main(int argc, char** argv) {
     gflags::ParseCommandLineFlags(&argc, &argv, true);
     
-    cout << "16x16 Systolic Array with MXINT4" << endl;
+    // Pre-quantized weights define the layer shape
+    std::unique_ptr<MappedWeights> mapped;
+    if (!FLAGS_load_weights.empty()) {
+        try {
+            mapped.reset(new MappedWeights(FLAGS_load_weights));
+        } catch (const std::exception& e) {
+            cout << e.what() << endl;
+            return 1;
+        }
+    }
+    
+    const int M = FLAGS_gemv ? 1 : FLAGS_m;
+    const int K = mapped ? mapped->K() : FLAGS_k;
+    const int N = mapped ? mapped->N() : FLAGS_n;
+    if (M < 1 || N < 1 || K < 1 || K > K_MAX) {
+        cout << "Invalid shape: need M, N >= 1 and 1 <= K <= " << K_MAX << endl;
+        return 1;
+    }
+    if (FLAGS_quant_bench) return run_quant_bench(K, N);
+    if (FLAGS_backend != "fpga" && FLAGS_backend != "model" && FLAGS_backend != "cpu") {
+        cout << "Unknown backend '" << FLAGS_backend << "' (fpga, model or cpu)" << endl;
+        return 1;
+    }
+    // The model takes every kernel call in place of the device, so all the
+    // FPGA paths (commands, sharding, epilogue, chaining) run unchanged
+    if (FLAGS_backend == "model") {
+        if (!FLAGS_bitstream.empty()) {
+            cout << "--backend=model runs without a --bitstream" << endl;
+            return 1;
+        }
+        FLAGS_bitstream = MODEL_BITSTREAM;
+    }
+    const Backend backend = (FLAGS_backend == "cpu") ? Backend::CPU : Backend::FPGA;
+    if (!FLAGS_bench.empty()) {
+        try {
+            return run_bench(backend);
+        } catch (const std::exception& e) {
+            cout << e.what() << endl;
+            return 1;
+        }
+    }
+    
+    if (FLAGS_sparsity < 0.0 || FLAGS_sparsity >= 1.0 || (FLAGS_sparsity > 0.0 && mapped)) {
+        cout << "--sparsity needs a fraction in [0, 1) and generated weights" << endl;
+        return 1;
+    }
+    
+    const bool stationary = FLAGS_stationary > 0;
+    if (stationary && !wgt_stationary_fits(K, N)) {
+        cout << "Weight-stationary mode needs N <= " << WGT_CACHE_SIZE * PE_COLS << " and K <= " << K_DIM
+             << " (W_cache holds " << WGT_CACHE_SIZE << " N-tiles)" << endl;
+        return 1;
+    }
+    const int run_cmd = stationary ? CMD_COMPUTE : CMD_RUN;
+    if (FLAGS_replicas < 1 || (FLAGS_replicas > 1 && (stationary || FLAGS_session > 0))) {
+        cout << "--replicas needs a value >= 1 and plain CMD_RUN calls (no --stationary / --session)" << endl;
+        return 1;
+    }
+    if (FLAGS_streams < 1 || FLAGS_qps < 0) {
+        cout << "--streams needs a value >= 1 and --qps a rate >= 0" << endl;
+        return 1;
+    }
+    
+    int epi = EPI_OFF;
+    if (FLAGS_epilogue == "requant") epi = EPI_REQUANT;
+    else if (FLAGS_epilogue == "relu") epi = EPI_RELU;
+    else if (FLAGS_epilogue == "gelu") epi = EPI_LUT;
+    else if (!FLAGS_epilogue.empty()) {
+        cout << "Unknown epilogue '" << FLAGS_epilogue << "' (requant, relu or gelu)" << endl;
+        return 1;
+    }
+    if (epi != EPI_OFF && (N > EPI_MAX_N || FLAGS_replicas > 1 || FLAGS_session > 0)) {
+        cout << "--epilogue needs N <= " << EPI_MAX_N << " and plain kernel calls (no --replicas / --session)" << endl;
+        return 1;
+    }
+    if (FLAGS_chain > 0) {
+        if (epi == EPI_OFF || mapped || stationary || (FLAGS_chain > 1 && !chain_fits(M, N))) {
+            cout << "--chain needs --epilogue, generated weights, M <= " << ACT_CACHE_SIZE * PE_ROWS
+                 << " and N <= " << K_DIM << " (no --stationary)" << endl;
+            return 1;
+        }
+        cout << "Layer chain: " << FLAGS_chain << " layers, M=" << M << ", K=" << K << ", N=" << N
+             << ", " << FLAGS_epilogue << " epilogue" << endl;
+        try {
+            return run_chain(backend, epi, M, K, N);
+        } catch (const std::exception& e) {
+            cout << e.what() << endl;
+            return 1;
+        }
+    }
+    
+    cout << PE_ROWS << "x" << PE_COLS << " Systolic Array with MXINT4" << (use_gemv(run_cmd, M, N) ? " (GEMV path)" : "")
+         << (use_ksplit(run_cmd, M, K, N) ? " (K-split x" + std::to_string(K_SPLIT) + ")" : "")
+         << (use_kstream(run_cmd, M, K, N) ? " (K-streaming x" + std::to_string(num_k_chunks(K)) + " chunks)" : "")
+         << (stationary ? " (weight-stationary)" : "")
+         << (epi != EPI_OFF ? " (" + FLAGS_epilogue + " epilogue)" : "") << endl;
     cout << "M=" << M << ", K=" << K << ", N=" << N << endl;
+    cout << "Weight format: groups of " << GROUP_SIZE << (wgt_fmt::along_k ? " along K, " : " along N, ")
+         << (wgt_fmt::exp_bits == 8 ? "E8M0 exponents" : "2-bit shifts") << endl;
     cout << "GFLOPs: " << (2.0 * M * K * N / 1e9) << endl;
     
     // Generate test data
@@ -127,43 +395,185 @@ int main(int argc, char** argv) {
     for (int i = 0; i < K * N; i++) {
         wgt_fp32[i] = ((i % 19) - 9) / 9.0f;  // Range ~[-1, 1]
     }
+    if (FLAGS_sparsity > 0.0) {
+        // Block (k / SPARSE_BLOCK, n / PE_COLS) is pruned when its hash
+        // lands below the target fraction
+        for (int k = 0; k < K; k++) {
+            for (int n = 0; n < N; n++) {
+                uint32_t h = (uint32_t)(k / SPARSE_BLOCK) * 2654435761u ^ (uint32_t)(n / PE_COLS) * 40503u;
+                h = (h ^ (h >> 15)) * 2246822519u;
+                if ((h >> 8) % 1000 < FLAGS_sparsity * 1000) wgt_fp32[k * N + n] = 0.0f;
+            }
+        }
+    }
+    
+    // Kernel layout: rows padded to whole 512-bit words
+    const int K_STRIDE = act_row_stride(K);
     
     // Quantize activations to INT8
-    aligned_vector<int8_t> act_int8(M * K);
-    for (int i = 0; i < M * K; i++) {
-        float val = act_fp32[i] * 127.0f;
-        act_int8[i] = (int8_t)std::max(-127.0f, std::min(127.0f, val));
+    aligned_vector<int8_t> act_int8(M * K_STRIDE, 0);
+    for (int m = 0; m < M; m++) {
+        for (int k = 0; k < K; k++) {
+            float val = act_fp32[m * K + k] * 127.0f;
+            act_int8[m * K_STRIDE + k] = (int8_t)std::max(-127.0f, std::min(127.0f, val));
+        }
+    }
+    // ACT_FORMAT=int4: onto the block-exponent grid the activation port
+    // carries, so the reference multiplies what the kernel sees
+    double act_err2 = 0.0, act_ref2 = 0.0;
+    if (SA_ACT_INT4) {
+        aligned_vector<int8_t> act_raw = act_int8;
+        round_activations(act_int8.data(), M, K, K_STRIDE);
+        for (size_t i = 0; i < act_raw.size(); i++) {
+            act_err2 += (double)(act_int8[i] - act_raw[i]) * (act_int8[i] - act_raw[i]);
+            act_ref2 += (double)act_raw[i] * act_raw[i];
+        }
     }
     
-    // Quantize weights to MXINT4
+    // Quantize weights to MXINT4 (pad columns are zero) and shard them over
+    // the HBM weight channels, or take both straight from a weight file.
+    // The kernel reads the mapping in place; the unsharded copy only feeds
+    // the CPU reference and backend.
     aligned_vector<uint8_t> wgt_packed;
     aligned_vector<uint8_t> scales;
-    quantize_mxint4(wgt_fp32, wgt_packed, scales, K, N);
+    shard_array_t wgt_shards;
+    shard_array_t scale_shards;
+    WeightView wgt_view;
+    if (mapped) {
+        wgt_view = mapped->view();
+        unshard_weights(wgt_view, wgt_packed, scales, K, N);
+    } else {
+        pack_weights(wgt_fp32, wgt_packed, scales, K, N);
+        shard_weights(wgt_packed, scales, wgt_shards, scale_shards, K, N);
+        wgt_view = view_shards(wgt_shards, scale_shards);
+    }
     
-    cout << "Quantized data:" << endl;
-    cout << "  Activations: " << act_int8.size() << " INT8" << endl;
+    cout << "Quantized data" << (mapped ? " (mapped from " + FLAGS_load_weights + ")" : "") << ":" << endl;
+    cout << "  Activations: " << act_int8.size() << " INT8, " << act_port_bytes(M, K) << " bytes on the port"
+         << (SA_ACT_INT4 ? " (int4 block-exponent)" : "") << endl;
+    if (SA_ACT_INT4) {
+        cout << "  Activation rounding error: " << 100.0 * std::sqrt(act_err2 / std::max(act_ref2, 1e-30))
+             << "% (relative RMS)" << endl;
+    }
     cout << "  Weights: " << wgt_packed.size() << " bytes (MXINT4 packed)" << endl;
     cout << "  Scales: " << scales.size() << " factors" << endl;
+    cout << "  HBM shards: " << WGT_CHANNELS << " x " << wgt_view.packed_bytes << " bytes" << endl;
+    if (SA_WGT_SPARSE) {
+        cout << "  Nonzero " << SPARSE_BLOCK << "x" << PE_COLS << " blocks: "
+             << 100.0 * weight_density(wgt_view, K, N) << "% (all the array path loads and multiplies)" << endl;
+    }
+    
+    if (!FLAGS_save_weights.empty()) {
+        try {
+            save_weights(FLAGS_save_weights, wgt_view, K, N);
+        } catch (const std::exception& e) {
+            cout << e.what() << endl;
+            return 1;
+        }
+        cout << "  Saved to " << FLAGS_save_weights << endl;
+    }
     
-    // Allocate output
+    if (FLAGS_session > 0) return run_session(backend, wgt_packed, scales, M, K, N);
+    
+    // Allocate output (device rows padded to whole result words)
+    const int OUT_STRIDE = out_row_stride(N);
+    aligned_vector<int32_t> out_dev(M * OUT_STRIDE);
     aligned_vector<int32_t> out_hw(M * N);
     aligned_vector<int32_t> out_cpu;
     
     // CPU reference
     cout << "\nRunning CPU reference..." << endl;
+    auto ref_start = std::chrono::steady_clock::now();
     cpu_reference(act_int8, wgt_packed, scales, out_cpu, M, K, N);
+    cout << "  " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - ref_start).count()
+         << " ms" << endl;
     
-    // Run accelerator
-    cout << "Running accelerator..." << endl;
-    tapa::invoke(
-        SystolicArrayKernel,
-        FLAGS_bitstream,
-        tapa::read_only_mmap<int8_t>(act_int8),
-        tapa::read_only_mmap<uint8_t>(wgt_packed),
-        tapa::read_only_mmap<uint8_t>(scales),
-        tapa::write_only_mmap<int32_t>(out_hw),
-        M, K, N
-    );
+    // How far 4-bit weights move the result from the fp32 weights (a few rows)
+    if (!mapped) {
+        double err2 = 0.0, ref2 = 0.0;
+        for (int m = 0; m < std::min(M, 8); m++) {
+            for (int n = 0; n < N; n++) {
+                double exact = 0.0;
+                for (int k = 0; k < K; k++) {
+                    exact += (double)act_int8[m * K_STRIDE + k] * wgt_fp32[k * N + n];
+                }
+                err2 += (out_cpu[m * N + n] - exact) * (out_cpu[m * N + n] - exact);
+                ref2 += exact * exact;
+            }
+        }
+        cout << "  Quantization error vs fp32 weights: " << 100.0 * std::sqrt(err2 / std::max(ref2, 1e-30))
+             << "% (relative RMS)" << endl;
+    }
+    
+    EpilogueParams epi_params;
+    aligned_vector<int8_t> q8_dev;
+    if (epi != EPI_OFF) {
+        epi_params = make_test_epilogue(epi, out_cpu, N);
+        q8_dev.assign(M * OUT_STRIDE, 0);
+    }
+    
+    // Run accelerator (or the CPU fallback, which follows the same commands)
+    CpuWeights cpu_wgt;
+    std::unique_ptr<ReplicatedLayer> replicated;
+    if (FLAGS_replicas > 1) {
+        replicated.reset(new ReplicatedLayer(wgt_packed, scales, K, N, FLAGS_replicas));
+        cout << "\nReplicas: " << replicated->replicas() << " x N ";
+        for (int r = 0; r < replicated->replicas(); r++) {
+            cout << (r ? ", " : "") << "[" << replicated->slice_begin(r) << ", "
+                 << replicated->slice_begin(r) + replicated->slice_n(r) << ")";
+        }
+        cout << endl;
+    }
+    auto run_kernel = [&](int cmd) -> int64_t {
+        if (replicated) {
+            return replicated->run(FLAGS_bitstream, backend, act_int8, out_dev.data(), OUT_STRIDE, M);
+        }
+        if (backend == Backend::FPGA) {
+            if (epi != EPI_OFF) return invoke_kernel(FLAGS_bitstream, act_int8, wgt_view, epi_params, q8_dev, M, K, N, cmd);
+            return invoke_kernel(FLAGS_bitstream, act_int8, wgt_view, out_dev, M, K, N, cmd);
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        if (cmd != CMD_COMPUTE) prepare_cpu_weights(wgt_packed, scales, cpu_wgt, K, N);
+        if (cmd != CMD_LOAD_WGT) {
+            cpu_gemm(act_int8, cpu_wgt, out_dev.data(), OUT_STRIDE, M);
+            if (epi != EPI_OFF) apply_epilogue(out_dev.data(), OUT_STRIDE, epi_params, q8_dev.data(), OUT_STRIDE, M);
+        }
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+    };
+    
+    cout << (backend == Backend::CPU ? "Running CPU backend..." :
+             FLAGS_backend == "model" ? "Running kernel model..." : "Running accelerator...") << endl;
+    if (stationary) {
+        // Weights cross PCIe/HBM once; every later call moves only activations
+        int64_t load_ns = run_kernel(CMD_LOAD_WGT);
+        int64_t compute_ns = 0;
+        for (int call = 0; call < FLAGS_stationary; call++) {
+            compute_ns += run_kernel(CMD_COMPUTE);
+        }
+        cout << "  Weight load: " << load_ns / 1e3 << " us" << endl;
+        cout << "  Compute: " << FLAGS_stationary << " calls, "
+             << compute_ns / 1e3 / FLAGS_stationary << " us/call" << endl;
+    } else {
+        run_kernel(CMD_RUN);
+    }
+    if (PROFILE && backend == Backend::FPGA && FLAGS_backend != "model") {
+        cout << "\nKernel profile (last call):\n" << format_profile(kernel_profile());
+    }
+    for (int m = 0; m < M; m++) {
+        std::copy_n(&out_dev[m * OUT_STRIDE], N, &out_hw[m * N]);
+    }
+    
+    // With the epilogue both sides are compared as int8 after it
+    if (epi != EPI_OFF) {
+        vector<int8_t> q8_cpu(M * N);
+        apply_epilogue(out_cpu.data(), N, epi_params, q8_cpu.data(), N, M);
+        for (int m = 0; m < M; m++) {
+            for (int n = 0; n < N; n++) {
+                out_hw[m * N + n] = q8_dev[m * OUT_STRIDE + n];
+                out_cpu[m * N + n] = q8_cpu[m * N + n];
+            }
+        }
+    }
     
     // Verify
     cout << "\nFirst 10 results:" << endl;
@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+
+#include "replicas.h"
+
+ReplicatedLayer::ReplicatedLayer(
+    const aligned_vector<uint8_t>& wgt_packed,
+    const aligned_vector<uint8_t>& scales,
+    int K, int N,
+    int replicas
+) : K_(K) {
+    if (K < 1 || K > K_MAX || N < 1 || replicas < 1) {
+        throw std::invalid_argument("ReplicatedLayer: needs 1 <= K <= K_MAX, N >= 1 and replicas >= 1");
+    }
+
+    // Whole rounds of WGT_CHANNELS N-tiles per replica; small layers may
+    // use fewer replicas than there are
+    const int chunk = round_up(num_tiles(N, replicas), PE_COLS * WGT_CHANNELS);
+    slices_.resize(num_tiles(N, chunk));
+    for (size_t r = 0; r < slices_.size(); r++) {
+        Slice& s = slices_[r];
+        s.n_begin = r * chunk;
+        s.N = std::min(chunk, N - s.n_begin);
+        slice_weights(wgt_packed, scales, K, N, s.n_begin, s.N, s.wgt_packed, s.scales);
+        shard_weights(s.wgt_packed, s.scales, s.wgt_shards, s.scale_shards, K, s.N);
+    }
+}
+
+int64_t ReplicatedLayer::run(
+    const std::string& bitstream,
+    Backend backend,
+    aligned_vector<int8_t>& act,
+    int32_t* out, int out_stride,
+    int M
+) {
+    auto t0 = std::chrono::steady_clock::now();
+
+    auto run_slice = [&](Slice& s) {
+        s.out.assign((size_t)M * out_row_stride(s.N), 0);
+        if (backend == Backend::FPGA) {
+            invoke_kernel(bitstream, act, view_shards(s.wgt_shards, s.scale_shards), s.out, M, K_, s.N, CMD_RUN);
+        } else {
+            if (s.cpu_wgt.N != s.N) prepare_cpu_weights(s.wgt_packed, s.scales, s.cpu_wgt, K_, s.N);
+            cpu_gemm(act, s.cpu_wgt, s.out.data(), out_row_stride(s.N), M);
+        }
+    };
+
+    // cpu_gemm is multithreaded already; the simulated kernel is not reentrant
+    if (backend == Backend::FPGA && !bitstream.empty()) {
+        std::vector<std::exception_ptr> errors(slices_.size());
+        std::vector<std::thread> workers;
+        for (size_t r = 0; r < slices_.size(); r++) {
+            workers.emplace_back([&, r] {
+                try {
+                    run_slice(slices_[r]);
+                } catch (...) {
+                    errors[r] = std::current_exception();
+                }
+            });
+        }
+        for (auto& w : workers) w.join();
+        for (auto& e : errors) {
+            if (e) std::rethrow_exception(e);
+        }
+    } else {
+        for (Slice& s : slices_) run_slice(s);
+    }
+
+    // Join: each replica wrote its own column block
+    for (const Slice& s : slices_) {
+        const int stride = out_row_stride(s.N);
+        for (int m = 0; m < M; m++) {
+            std::copy_n(&s.out[(size_t)m * stride], s.N, &out[(size_t)m * out_stride + s.n_begin]);
+        }
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+}
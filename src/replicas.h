@@ -0,0 +1,68 @@
+#ifndef REPLICAS_H_
+#define REPLICAS_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "host.h"
+
+// ============================================================================
+// ReplicatedLayer: one layer spread over several SystolicArrayKernel
+// compute units
+//
+// The multi-SLR build (make REPLICAS=3) links one compute unit per SLR, each
+// with its own HBM pseudo-channels (config/hbm_u55c_x3.cfg). The layer's
+// N-tiles are split into one column slice per replica, rounded to whole
+// rounds of WGT_CHANNELS tiles so no replica streams padding; every slice is
+// quantized once and sharded for its own replica. run() issues one kernel
+// call per slice concurrently (XRT hands each to an idle compute unit) and
+// joins the column blocks into one result. In software simulation the
+// kernel's on-chip caches are process-wide, so the slices run one after
+// another there.
+// ============================================================================
+class ReplicatedLayer {
+ public:
+    // K x N layer in the padded MXINT4 layout of pack_weights()
+    ReplicatedLayer(
+        const aligned_vector<uint8_t>& wgt_packed,
+        const aligned_vector<uint8_t>& scales,
+        int K, int N,
+        int replicas
+    );
+
+    ReplicatedLayer(const ReplicatedLayer&) = delete;
+    ReplicatedLayer& operator=(const ReplicatedLayer&) = delete;
+
+    int replicas() const { return (int)slices_.size(); }
+    int slice_begin(int r) const { return slices_[r].n_begin; }
+    int slice_n(int r) const { return slices_[r].N; }
+
+    // out[m * out_stride + n] = act x W for M rows of activations in the
+    // kernel layout (CMD_RUN on every replica). Returns the time of the
+    // whole call in nanoseconds.
+    int64_t run(
+        const std::string& bitstream,
+        Backend backend,
+        aligned_vector<int8_t>& act,
+        int32_t* out, int out_stride,
+        int M
+    );
+
+ private:
+    struct Slice {
+        int n_begin = 0;
+        int N = 0;
+        aligned_vector<uint8_t> wgt_packed;
+        aligned_vector<uint8_t> scales;
+        shard_array_t wgt_shards;
+        shard_array_t scale_shards;
+        CpuWeights cpu_wgt;          // Backend::CPU, prepared on first use
+        aligned_vector<int32_t> out; // M x out_row_stride(N)
+    };
+
+    int K_;
+    std::vector<Slice> slices_;
+};
+
+#endif
@@ -1,155 +1,1479 @@
 #include "sa.h"
 
 // ============================================================================
-// SMART CACHE: 4MB with CONSTANT loop bounds
+// TASK GRAPH (ping-pong dataflow)
+//
+//   LoadAct ───── act_q ──────┐
+//                             ├─> Compute ── out_q ──> Epilogue ── res_q ──> StoreResult
+//   LoadWgt ── wgt_raw_q ─────┘                            ├─── q8_q ──> StoreQ8
+//          ├── gemv_raw_q ────┘   (M=1 decode path)        │
+//          └── wgt_idx_q ─────┘   (SA_WGT_SPARSE)          │
+//   LoadAct <──────────────── chain_q ─────────────────────┘  (CHAIN_OUT)
+//
+// With SA_PROFILE every task also reports its phases to a Profiler task.
+//
+// LoadWgt runs once per HBM weight channel; Compute takes N-tile t from
+// channel t % WGT_CHANNELS (GEMV: all channels every cycle).
+//
+// Compute walks N-tiles in order and reuses every cached M-tile against the
+// current weight tile. While tile t is multiplied, tile t+1 is fetched and
+// drained into the next W_cache slot, so HBM and the array stay busy at the
+// same time. Weights stay MXINT4 on chip and are dequantized as they enter
+// the array.
 // ============================================================================
 
-static int8_t A_cache[8][PE_ROWS][K_DIM];
-static int8_t W_cache[32][PE_COLS][K_DIM];  // *** CHANGED: Cache ALL 32 N-tiles ***
+static int8_t A_cache[ACT_CACHE_SIZE][PE_ROWS][K_DIM];
+static uint8_t W_cache[WGT_CACHE_SIZE][PE_COLS / 2][K_DIM];          // packed nibbles
+static uint8_t W_scale[WGT_CACHE_SIZE][COL_SCALES][K_DIM / K_GROUP];  // group exponents
+#if SA_WGT_SPARSE
+// Nonzero blocks of each slot's N-tile; W_cache/W_scale hold only their
+// columns, packed from column 0
+static blk_idx_t W_blk[WGT_CACHE_SIZE][SPARSE_MAX_BLOCKS];
+static int W_nblk[WGT_CACHE_SIZE];
+#endif
 
-static int8_t A_work[PE_ROWS][K_DIM];
-static int8_t W_work[PE_COLS][K_DIM];
-static int32_t C_work[PE_ROWS][PE_COLS];
+static acc_t C_work[PE_ROWS][PE_COLS];
+// Partial sums of one N-group of every M-tile of the block between
+// K-chunks (K-streaming)
+static acc_t C_acc[ACT_CACHE_SIZE][ACC_TILES][PE_ROWS][PE_COLS];
+#if !SA_WGT_TILE_MAJOR
+static acc_t Y_acc[GEMV_MAX_WORDS][WGT_CHANNELS][GEMV_LANES];  // GEMV outputs
+#endif
 
-void SystolicArrayKernel(
-    tapa::mmap<int8_t> activations,
-    tapa::mmap<uint8_t> weights_packed,
-    tapa::mmap<uint8_t> scales,
-    tapa::mmap<int32_t> result,
-    int M, int K, int N
+// Chained results (CHAIN_OUT), one M-block of K-columns; bank chain_cur holds
+// the last one
+static int8_t A_chain[2][ACT_CACHE_SIZE][K_DIM][PE_ROWS];
+static int chain_cur = 0;
+
+#if SA_SYSTOLIC_MESH
+// Pipeline registers between neighbouring PEs
+static int8_t A_reg[PE_ROWS][PE_COLS];
+static wgt_t W_reg[PE_ROWS][PE_COLS];
+#endif
+
+// ============================================================================
+// ROW ORDER: position of the tile rows Compute emits, in (m_block, n_tile,
+// m_tile, i) order (GEMV: its single row as one run of N-tiles)
+// ============================================================================
+struct RowPos {
+    int TILE_ROWS;
+    int NUM_M_TILES;
+    int NUM_N_TILES;
+
+    int m_base;
+    int n_tile;
+    int m_tile;
+    int i;
+    int block_tiles;
+
+    RowPos(int M, int N, int cmd) {
+        const bool GEMV = use_gemv(cmd, M, N);
+        TILE_ROWS = GEMV ? 1 : PE_ROWS;
+        NUM_M_TILES = GEMV ? 1 : num_tiles(M, PE_ROWS);
+        NUM_N_TILES = GEMV ? num_tiles(N, PE_COLS) : num_n_tiles(N);
+        m_base = 0;
+        n_tile = 0;
+        m_tile = 0;
+        i = 0;
+        block_tiles = (NUM_M_TILES < ACT_CACHE_SIZE) ? NUM_M_TILES : ACT_CACHE_SIZE;
+    }
+
+    int m_idx() const { return m_tile * TILE_ROWS + i; }
+
+    void next() {
+        if (++i == TILE_ROWS) {
+            i = 0;
+            if (++m_tile == m_base + block_tiles) {
+                if (++n_tile == NUM_N_TILES) {
+                    n_tile = 0;
+                    m_base += ACT_CACHE_SIZE;
+                    block_tiles = (NUM_M_TILES - m_base < ACT_CACHE_SIZE) ? NUM_M_TILES - m_base : ACT_CACHE_SIZE;
+                }
+                m_tile = m_base;
+            }
+        }
+    }
+};
+
+// ============================================================================
+// LOAD ACTIVATIONS: one 512-bit word per row, transposed into K-columns.
+// M-tiles [m_begin, m_end), K-columns [k_begin, k_end) with k_begin on a
+// word boundary (a K-chunk when K-streaming, else everything).
+// ============================================================================
+static void load_act(
+    tapa::mmap<act_word_t>& activations,
+    tapa::ostream<act_vec_t>& act_q,
+    int M, int K,
+    int m_begin, int m_end,
+    int k_begin, int k_end
+) {
+    const int ROW_WORDS = act_row_words(K);
+    const int W_BEGIN = k_begin / ACT_PER_WORD;
+    const int W_END = num_tiles(k_end, ACT_PER_WORD);
+
+    act_word_t rows[PE_ROWS];
+    #pragma HLS ARRAY_PARTITION variable=rows complete dim=0
+#if SA_ACT_INT4
+    // Exponent bytes sit after the M mantissa rows
+    const int EXP_BASE = M * ROW_WORDS;
+    const int EXP_ROW_WORDS = act_exp_row_words(K);
+    act_word_t exps[PE_ROWS];
+    #pragma HLS ARRAY_PARTITION variable=exps complete dim=0
+#endif
+
+    load_all_act: for (int m_tile = m_begin; m_tile < m_end; ++m_tile) {
+        #pragma HLS loop_tripcount min=M_DIM/PE_ROWS max=M_DIM/PE_ROWS avg=M_DIM/PE_ROWS
+
+        load_act_tile: for (int kw = W_BEGIN; kw < W_END; ++kw) {
+            #pragma HLS loop_tripcount min=K_DIM/ACT_PER_WORD max=K_DIM/ACT_PER_WORD avg=K_DIM/ACT_PER_WORD
+
+#if SA_ACT_INT4
+            // ---- exponent word of PE_ROWS rows, once per ACT_WORDS_PER_EXP words ----
+            if (kw == W_BEGIN || kw % ACT_WORDS_PER_EXP == 0) {
+                read_exps: for (int i = 0; i < PE_ROWS; ++i) {
+                    #pragma HLS PIPELINE II=1
+
+                    int m_idx = m_tile * PE_ROWS + i;
+                    act_word_t word;
+                    if (m_idx < M) {
+                        word = activations[EXP_BASE + m_idx * EXP_ROW_WORDS + kw / ACT_WORDS_PER_EXP];
+                    } else {
+                        for (int c = 0; c < AXI_BYTES; ++c) {
+                            #pragma HLS UNROLL
+                            word[c] = 0;
+                        }
+                    }
+                    exps[i] = word;
+                }
+            }
+#endif
+
+            // ---- same word of PE_ROWS rows (rows past M read as zero) ----
+            read_rows: for (int i = 0; i < PE_ROWS; ++i) {
+                #pragma HLS PIPELINE II=1
+
+                int m_idx = m_tile * PE_ROWS + i;
+                act_word_t word;
+                if (m_idx < M) {
+                    word = activations[m_idx * ROW_WORDS + kw];
+                } else {
+                    for (int c = 0; c < AXI_BYTES; ++c) {
+                        #pragma HLS UNROLL
+                        word[c] = 0;
+                    }
+                }
+                rows[i] = word;
+            }
+
+            // ---- transpose: one PE_ROWS-wide K-column per cycle ----
+            emit_cols: for (int c = 0; c < ACT_PER_WORD; ++c) {
+                #pragma HLS PIPELINE II=1
+
+                const int k = kw * ACT_PER_WORD + c;
+                if (k >= k_begin && k < k_end) {
+                    act_vec_t col;
+                    for (int i = 0; i < PE_ROWS; ++i) {
+                        #pragma HLS UNROLL
+#if SA_ACT_INT4
+                        // Sign-extended mantissa nibble times 2^e of its block
+                        int8_t q = (int8_t)(rows[i][c / 2] << (4 * (1 - c % 2))) >> 4;
+                        col[i] = (int8_t)(q * (1 << exps[i][(k / ACT_BLOCK) % AXI_BYTES]));
+#else
+                        col[i] = rows[i][c];
+#endif
+                    }
+                    act_q.write(col);
+                }
+            }
+        }
+    }
+}
+
+// ============================================================================
+// ACTIVATION PORT: HBM activations, or the K-columns of the chained result
+// (CHAIN_IN). With CHAIN_OUT the int8 result rows of this call come back
+// once the activations are sent (Compute holds the whole M-block by then)
+// and are kept in the other A_chain bank for the next call.
+// ============================================================================
+void LoadAct(
+    tapa::mmap<act_word_t> activations,
+    tapa::ostream<act_vec_t>& act_q,
+    tapa::istream<q8_vec_t>& chain_q,
+    tapa::ostream<prof_event_t>& prof_q,
+    int M, int K, int N, int cmd, int epi, int chain
+) {
+    // A K-column per cycle out, PE_COLS columns of one row per cycle in
+    #pragma HLS ARRAY_PARTITION variable=A_chain complete dim=4
+    #pragma HLS ARRAY_PARTITION variable=A_chain cyclic factor=PE_COLS dim=3
+    #pragma HLS BIND_STORAGE variable=A_chain type=RAM_2P impl=BRAM
+
+    if (cmd == CMD_LOAD_WGT) {
+        prof_mark(prof_q, PH_DONE, 0);
+        return;
+    }
+
+    const int NUM_M_TILES = num_tiles(M, PE_ROWS);
+
+    if (use_chain_in(cmd, M, chain)) {
+        chain_act: for (int m_tile = 0; m_tile < NUM_M_TILES; ++m_tile) {
+            #pragma HLS loop_tripcount min=M_DIM/PE_ROWS max=M_DIM/PE_ROWS avg=M_DIM/PE_ROWS
+            for (int k = 0; k < K; ++k) {
+                #pragma HLS PIPELINE II=1
+                #pragma HLS loop_tripcount min=K_DIM max=K_DIM avg=K_DIM
+                act_vec_t col;
+                for (int i = 0; i < PE_ROWS; ++i) {
+                    #pragma HLS UNROLL
+                    col[i] = (m_tile * PE_ROWS + i < M) ? A_chain[chain_cur][m_tile][k][i] : (int8_t)0;
+                }
+                act_q.write(col);
+            }
+        }
+        prof_mark(prof_q, PH_CHAIN_ACT, NUM_M_TILES * K);
+    } else if (use_kstream(cmd, M, K, N)) {
+        // ---- K-streaming: every K-chunk of an M-block, once per N-group ----
+        const int NUM_N_GROUPS = num_tiles(num_n_tiles(N), n_group_tiles(cmd, M, K, N));
+        int words = 0;
+        act_blocks: for (int m_base = 0; m_base < NUM_M_TILES; m_base += ACT_CACHE_SIZE) {
+            #pragma HLS loop_tripcount min=M_DIM/PE_ROWS/ACT_CACHE_SIZE max=M_DIM/PE_ROWS/ACT_CACHE_SIZE avg=M_DIM/PE_ROWS/ACT_CACHE_SIZE
+
+            const int m_end = (NUM_M_TILES - m_base < ACT_CACHE_SIZE) ? NUM_M_TILES : m_base + ACT_CACHE_SIZE;
+            act_groups: for (int g = 0; g < NUM_N_GROUPS; ++g) {
+                #pragma HLS loop_tripcount min=1 max=1 avg=1
+                act_chunks: for (int c = 0; c < num_k_chunks(K); ++c) {
+                    #pragma HLS loop_tripcount min=K_MAX/K_DIM max=K_MAX/K_DIM avg=K_MAX/K_DIM
+                    load_act(activations, act_q, M, K, m_base, m_end, c * K_DIM, c * K_DIM + chunk_cols(K, c));
+                    words += (m_end - m_base) * num_tiles(chunk_cols(K, c), ACT_PER_WORD);
+                }
+            }
+        }
+        prof_mark(prof_q, PH_HBM_ACT, words * (PE_ROWS + ACT_PER_WORD));
+    } else {
+        load_act(activations, act_q, M, K, 0, NUM_M_TILES, 0, K);
+        prof_mark(prof_q, PH_HBM_ACT, NUM_M_TILES * act_row_words(K) * (PE_ROWS + ACT_PER_WORD));
+    }
+
+    if (use_chain_out(cmd, M, N, epi, chain)) {
+        const int bank = chain_cur ^ 1;
+        const int TILES = num_tiles(N, PE_COLS);
+        RowPos pos(M, N, cmd);
+        chain_rows: for (int r = 0; r < num_out_rows(M, N, cmd); ++r) {
+            #pragma HLS PIPELINE II=1
+            #pragma HLS loop_tripcount min=M_DIM*N_DIM/PE_COLS max=M_DIM*N_DIM/PE_COLS avg=M_DIM*N_DIM/PE_COLS
+            q8_vec_t row = chain_q.read();
+            if (pos.n_tile < TILES) {
+                for (int j = 0; j < PE_COLS; ++j) {
+                    #pragma HLS UNROLL
+                    A_chain[bank][pos.m_tile][pos.n_tile * PE_COLS + j][pos.i] = row[j];
+                }
+            }
+            pos.next();
+        }
+        chain_cur = bank;
+        prof_mark(prof_q, PH_CHAIN_ROWS, num_out_rows(M, N, cmd));
+    }
+    prof_mark(prof_q, PH_DONE, 0);
+}
+
+// ============================================================================
+// LOAD WEIGHTS: raw MXINT4 bytes + scales of one HBM shard. Every channel
+// runs this same loop over its local tiles.
+// ============================================================================
+void LoadWgt(
+    tapa::mmap<byte_word_t> weights_packed,
+    tapa::mmap<byte_word_t> scales,
+    tapa::ostream<wgt_raw_t>& wgt_raw_q,
+    tapa::ostream<gemv_raw_t>& gemv_raw_q,
+    tapa::ostream<blk_idx_t>& wgt_idx_q,
+    tapa::ostream<prof_event_t>& prof_q,
+    int M, int K, int N, int cmd
+) {
+    if (cmd == CMD_COMPUTE) {  // weights already parked in W_cache
+        prof_mark(prof_q, PH_DONE, 0);
+        return;
+    }
+
+    if (use_gemv(cmd, M, N) || use_ksplit(cmd, M, K, N)) {
+        // ---- GEMV / K-split: one sequential pass over the shard, a full word per cycle ----
+#if SA_WGT_TILE_MAJOR
+        // Tile after tile, COLS_PER_WORD K-columns per word; each scale
+        // word is fetched once, by the first word that needs it
+        const int TILE_WORDS = wgt_tile_words(K);
+        const int NUM_WORDS = wgt_shard_tiles(N) * TILE_WORDS;
+#else
+        // A shard row is exactly wgt_shard_stride(N) / GEMV_LANES words, so
+        // the whole shard is one contiguous run of words
+        const int NUM_WORDS = K * (wgt_shard_stride(N) / GEMV_LANES);
+#endif
+        byte_word_t scale_word;
+
+        load_gemv_wgt: for (int w_word = 0; w_word < NUM_WORDS; ++w_word) {
+            #pragma HLS PIPELINE II=1
+            #pragma HLS loop_tripcount min=K_DIM*GEMV_MAX_N/GEMV_LANES max=K_DIM*GEMV_MAX_N/GEMV_LANES avg=K_DIM*GEMV_MAX_N/GEMV_LANES
+
+            // First exponent of the word
+#if SA_WGT_TILE_MAJOR
+            int k0 = (w_word % TILE_WORDS) * COLS_PER_WORD;
+            int s_idx = scale_col_offset(K, N, k0, w_word / TILE_WORDS);
+            if (k0 % K_GROUP == 0 && s_idx % AXI_BYTES == 0) scale_word = scales[s_idx / AXI_BYTES];
+#else
+            int s_idx = w_word * GEMV_SCALES;
+            if (s_idx % AXI_BYTES == 0) scale_word = scales[s_idx / AXI_BYTES];
+#endif
+            byte_word_t packed = weights_packed[w_word];
+
+            gemv_raw_t raw;
+            for (int b = 0; b < GEMV_LANES / 2; ++b) {
+                #pragma HLS UNROLL
+                raw.packed_bytes[b] = packed[b];
+            }
+            for (int g = 0; g < GEMV_SCALES; ++g) {
+                #pragma HLS UNROLL
+                raw.scale_factors[g] = scale_word[s_idx % AXI_BYTES + g];
+            }
+            gemv_raw_q.write(raw);
+        }
+        prof_mark(prof_q, PH_LOAD_WGT, NUM_WORDS);
+        prof_mark(prof_q, PH_DONE, 0);
+        return;
+    }
+
+    const int LOCAL_TILES = wgt_shard_tiles(N);
+    const int NUM_PASSES = (cmd == CMD_RUN) ? num_wgt_passes(M, K, N) : 1;
+
+#if SA_WGT_SPARSE
+    // ---- Block-sparse: index first, then only the nonzero blocks ----
+    const int K_PAD = wgt_tile_words(K) * COLS_PER_WORD;  // columns stored per tile
+    int num_cols = 0;
+
+    load_sparse_wgt: for (int tile = 0; tile < NUM_PASSES * LOCAL_TILES; ++tile) {
+        #pragma HLS loop_tripcount min=N_DIM/PE_COLS/WGT_CHANNELS max=N_DIM/PE_COLS/WGT_CHANNELS avg=N_DIM/PE_COLS/WGT_CHANNELS
+
+        int local_tile = tile % LOCAL_TILES;
+        const int INDEX_BASE = sparse_index_word(K, N, local_tile);
+        blk_idx_t blocks[SPARSE_MAX_BLOCKS];
+        byte_word_t index_word = weights_packed[INDEX_BASE];
+        const int NUM_BLOCKS = index_word[0] | (index_word[1] << 8);
+
+        // Compute learns the tile's blocks before its columns arrive
+        wgt_idx_q.write(NUM_BLOCKS);
+        load_wgt_index: for (int e = 1; e <= NUM_BLOCKS; ++e) {
+            #pragma HLS PIPELINE II=1
+            #pragma HLS loop_tripcount min=0 max=SPARSE_MAX_BLOCKS avg=SPARSE_MAX_BLOCKS/2
+
+            if (e % INDEX_PER_WORD == 0) index_word = weights_packed[INDEX_BASE + e / INDEX_PER_WORD];
+            const int byte = (e % INDEX_PER_WORD) * 2;
+            blk_idx_t blk = index_word[byte] | (index_word[byte + 1] << 8);
+            blocks[e - 1] = blk;
+            wgt_idx_q.write(blk);
+        }
+
+        // Blocks start on word (and group) boundaries, so a word is fetched
+        // by its first column; an exponent word by the first column that
+        // needs it. Columns past the stored tile (groups along K longer
+        // than K) are zero.
+        byte_word_t packed, scale_word;
+        int scale_addr = -1;
+
+        load_wgt_blocks: for (int c = 0; c < NUM_BLOCKS * SPARSE_BLOCK; ++c) {
+            #pragma HLS PIPELINE II=1
+            #pragma HLS loop_tripcount min=0 max=K_DIM avg=K_DIM/2
+
+            int k = blocks[c / SPARSE_BLOCK] * SPARSE_BLOCK + c % SPARSE_BLOCK;
+            int b_idx = wgt_col_offset(K, N, k, local_tile);
+            int s_idx = scale_col_offset(K, N, k, local_tile);
+
+            if (k < K_PAD && k % COLS_PER_WORD == 0) packed = weights_packed[b_idx / AXI_BYTES];
+            if (s_idx / AXI_BYTES != scale_addr) {
+                scale_addr = s_idx / AXI_BYTES;
+                scale_word = scales[scale_addr];
+            }
+
+            wgt_raw_t raw;
+            for (int b = 0; b < COL_BYTES; ++b) {
+                #pragma HLS UNROLL
+                raw.packed_bytes[b] = (k < K_PAD) ? packed[b_idx % AXI_BYTES + b] : (uint8_t)0;
+            }
+            for (int g = 0; g < COL_SCALES; ++g) {
+                #pragma HLS UNROLL
+                raw.scale_factors[g] = scale_word[s_idx % AXI_BYTES + g];
+            }
+            wgt_raw_q.write(raw);
+        }
+        num_cols += NUM_BLOCKS * SPARSE_BLOCK;
+    }
+    prof_mark(prof_q, PH_LOAD_WGT, num_cols);
+#else
+    (void)wgt_idx_q;  // block index, sparse builds only
+    // Tiles once per pass; when K-streaming, per N-group every K-chunk of
+    // the group's tiles (a single chunk and group otherwise)
+    const int GROUP_TILES = n_group_tiles(cmd, M, K, N) / WGT_CHANNELS;
+    int num_cols = 0;
+
+    load_all_wgt: for (int tile = 0; tile < NUM_PASSES * LOCAL_TILES * num_k_chunks(K); ++tile) {
+        #pragma HLS loop_tripcount min=N_DIM/PE_COLS/WGT_CHANNELS max=N_DIM/PE_COLS/WGT_CHANNELS avg=N_DIM/PE_COLS/WGT_CHANNELS
+
+        const int in_pass = tile % (LOCAL_TILES * num_k_chunks(K));
+        const int group_base = in_pass / (GROUP_TILES * num_k_chunks(K)) * GROUP_TILES;
+        const int group_size = (LOCAL_TILES - group_base < GROUP_TILES) ? LOCAL_TILES - group_base : GROUP_TILES;
+        const int in_group = in_pass - group_base * num_k_chunks(K);
+        const int chunk = in_group / group_size;
+        const int local_tile = group_base + in_group % group_size;
+        const int k_begin = chunk * K_DIM;
+        const int k_end = k_begin + chunk_cols(K, chunk);
+        byte_word_t packed, scale_word;
+
+        load_wgt_tile: for (int k = k_begin; k < k_end; ++k) {
+            #pragma HLS PIPELINE II=1
+            #pragma HLS loop_tripcount min=K_DIM max=K_DIM avg=K_DIM
+
+            // One K-column of the tile: PE_COLS/2 bytes and COL_SCALES
+            // exponents, each inside a single word. Tile-major shards hand
+            // out consecutive columns of the same word (and K_GROUP columns
+            // share their exponents), so a word is fetched when the tile
+            // reaches it and then reused; row-major columns each need their
+            // own word. Columns past N are zero in the padded host layout.
+            int b_idx = wgt_col_offset(K, N, k, local_tile);
+            int s_idx = scale_col_offset(K, N, k, local_tile);
+
+            if (!SA_WGT_TILE_MAJOR || b_idx % AXI_BYTES == 0 || k == k_begin) packed = weights_packed[b_idx / AXI_BYTES];
+            if (!SA_WGT_TILE_MAJOR || (k % K_GROUP == 0 && s_idx % AXI_BYTES == 0) || k == k_begin) {
+                scale_word = scales[s_idx / AXI_BYTES];
+            }
+
+            wgt_raw_t raw;
+            for (int b = 0; b < COL_BYTES; ++b) {
+                #pragma HLS UNROLL
+                raw.packed_bytes[b] = packed[b_idx % AXI_BYTES + b];
+            }
+            for (int g = 0; g < COL_SCALES; ++g) {
+                #pragma HLS UNROLL
+                raw.scale_factors[g] = scale_word[s_idx % AXI_BYTES + g];
+            }
+            wgt_raw_q.write(raw);
+        }
+        num_cols += k_end - k_begin;
+    }
+    prof_mark(prof_q, PH_LOAD_WGT, num_cols);
+#endif
+    prof_mark(prof_q, PH_DONE, 0);
+}
+
+// ============================================================================
+// W_cache access: columns are parked raw and dequantized on the way out
+// ============================================================================
+static void cache_wgt_col(int slot, int k, const wgt_raw_t& raw) {
+    #pragma HLS INLINE
+    for (int b = 0; b < PE_COLS / 2; ++b) {
+        #pragma HLS UNROLL
+        W_cache[slot][b][k] = raw.packed_bytes[b];
+    }
+    for (int g = 0; g < COL_SCALES; ++g) {
+        #pragma HLS UNROLL
+        W_scale[slot][g][k / K_GROUP] = raw.scale_factors[g];
+    }
+}
+
+static wgt_t cached_wgt(int slot, int j, int k) {
+    #pragma HLS INLINE
+    return wgt_fmt::dequant(
+        W_cache[slot][j / 2][k], j & 1, W_scale[slot][wgt_fmt::lane_scale(j)][k / K_GROUP]
+    );
+}
+
+#if !SA_SYSTOLIC_MESH
+// K index of cached column c (block-sparse slots pack their nonzero blocks;
+// broadcast engine only)
+static int cached_k(int slot, int c) {
+    #pragma HLS INLINE
+#if SA_WGT_SPARSE
+    return W_blk[slot][c / SPARSE_BLOCK] * SPARSE_BLOCK + c % SPARSE_BLOCK;
+#else
+    (void)slot;
+    return c;
+#endif
+}
+#endif
+
+#if SA_WGT_SPARSE
+// Block index of the next N-tile of channel ch into slot; returns the
+// number of columns that follow it on wgt_raw_q
+static int recv_wgt_index(tapa::istreams<blk_idx_t, WGT_CHANNELS>& wgt_idx_q, int ch, int slot) {
+    #pragma HLS INLINE
+    const int NUM_BLOCKS = read_channel(wgt_idx_q, ch);
+    W_nblk[slot] = NUM_BLOCKS;
+    recv_index: for (int e = 0; e < NUM_BLOCKS; ++e) {
+        #pragma HLS PIPELINE II=1
+        #pragma HLS loop_tripcount min=0 max=SPARSE_MAX_BLOCKS avg=SPARSE_MAX_BLOCKS/2
+
+        W_blk[slot][e] = read_channel(wgt_idx_q, ch);
+    }
+    return NUM_BLOCKS * SPARSE_BLOCK;
+}
+#endif
+
+// ============================================================================
+// COMPUTE: PE_ROWS×PE_COLS array, double-buffered over N-tiles, one M-block at a time
+// ============================================================================
+void Compute(
+    tapa::istream<act_vec_t>& act_q,
+    tapa::istreams<wgt_raw_t, WGT_CHANNELS>& wgt_raw_q,
+    tapa::istreams<gemv_raw_t, WGT_CHANNELS>& gemv_raw_q,
+    tapa::istreams<blk_idx_t, WGT_CHANNELS>& wgt_idx_q,
+    tapa::ostream<out_vec_t>& out_q,
+#if SA_K_SPLIT > 1
+    tapa::ostreams<act_vec_t, K_SPLIT>& slice_act_q,
+    tapa::ostreams<gemv_raw_t, K_SPLIT>& slice_wgt_q,
+#endif
+    tapa::ostream<prof_event_t>& prof_q,
+    int M, int K, int N, int cmd
 ) {
-    #pragma HLS INLINE off
-    
     // ---- Array Partitioning ----
     #pragma HLS ARRAY_PARTITION variable=A_cache complete dim=2
     #pragma HLS ARRAY_PARTITION variable=W_cache complete dim=2
-    #pragma HLS ARRAY_PARTITION variable=A_work complete dim=1
-    #pragma HLS ARRAY_PARTITION variable=W_work complete dim=1
+    #pragma HLS ARRAY_PARTITION variable=W_scale complete dim=2
     #pragma HLS ARRAY_PARTITION variable=C_work complete dim=0
-    
+    #pragma HLS ARRAY_PARTITION variable=C_acc complete dim=3
+    #pragma HLS ARRAY_PARTITION variable=C_acc complete dim=4
+#if SA_SYSTOLIC_MESH
+    #pragma HLS ARRAY_PARTITION variable=A_reg complete dim=0
+    #pragma HLS ARRAY_PARTITION variable=W_reg complete dim=0
+#endif
+
     #pragma HLS BIND_STORAGE variable=A_cache type=RAM_2P impl=BRAM
     #pragma HLS BIND_STORAGE variable=W_cache type=RAM_2P impl=URAM
-    #pragma HLS BIND_STORAGE variable=A_work type=RAM_2P impl=BRAM
-    #pragma HLS BIND_STORAGE variable=W_work type=RAM_2P impl=BRAM
-    
-    const int NUM_M_TILES = M / PE_ROWS;  // 8
-    const int NUM_N_TILES = N / PE_COLS;  // 32
-    
-    // ============================================================================
-    // PHASE 1: LOAD ALL ACTIVATIONS (64KB)
-    // ============================================================================
-    load_all_act: for (int m_tile = 0; m_tile < NUM_M_TILES; ++m_tile) {
-        // #pragma HLS loop_tripcount min=8 max=8 avg=8
-        #pragma HLS loop_tripcount min=M_DIM/PE_ROWS max=M_DIM/PE_ROWS avg=M_DIM/PE_ROWS
-        
-        load_act_tile: for (int idx = 0; idx < PE_ROWS * K; ++idx) {
+    #pragma HLS BIND_STORAGE variable=W_scale type=RAM_2P impl=BRAM
+#if !SA_WGT_TILE_MAJOR
+    #pragma HLS ARRAY_PARTITION variable=Y_acc complete dim=2
+    #pragma HLS ARRAY_PARTITION variable=Y_acc complete dim=3
+#endif
+
+    if (cmd == CMD_LOAD_WGT) {
+        // ============================================================================
+        // WEIGHT-STATIONARY LOAD: N-tile t is parked in slot t for later
+        // CMD_COMPUTE calls
+        // ============================================================================
+#if SA_WGT_SPARSE
+        int num_cols = 0;
+        park_sparse: for (int n_tile = 0; n_tile < num_n_tiles(N); ++n_tile) {
+            #pragma HLS loop_tripcount min=N_DIM/PE_COLS max=N_DIM/PE_COLS avg=N_DIM/PE_COLS
+
+            const int TILE_COLS = recv_wgt_index(wgt_idx_q, n_tile % WGT_CHANNELS, n_tile);
+            park_blocks: for (int c = 0; c < TILE_COLS; ++c) {
+                #pragma HLS PIPELINE II=1
+                #pragma HLS loop_tripcount min=0 max=K_DIM avg=K_DIM/2
+
+                cache_wgt_col(n_tile, c, read_channel(wgt_raw_q, n_tile % WGT_CHANNELS));
+            }
+            num_cols += TILE_COLS;
+        }
+        prof_mark(prof_q, PH_RECV_WGT, num_cols);
+#else
+        park_wgt: for (int idx = 0; idx < num_n_tiles(N) * K; ++idx) {
             #pragma HLS PIPELINE II=1
-            // #pragma HLS loop_tripcount min=8192 max=8192 avg=8192
-            #pragma HLS loop_tripcount min=PE_ROWS*K_DIM max=PE_ROWS*K_DIM avg=PE_ROWS*K_DIM
-            
-            int i = idx / K;
+            #pragma HLS loop_tripcount min=N_DIM/PE_COLS*K_DIM max=N_DIM/PE_COLS*K_DIM avg=N_DIM/PE_COLS*K_DIM
+
+            int n_tile = idx / K;
             int k = idx % K;
-            int m_idx = m_tile * PE_ROWS + i;
-            A_cache[m_tile][i][k] = activations[m_idx * K + k];
+            cache_wgt_col(n_tile, k, read_channel(wgt_raw_q, n_tile % WGT_CHANNELS));
         }
+        prof_mark(prof_q, PH_RECV_WGT, num_n_tiles(N) * K);
+#endif
+        prof_mark(prof_q, PH_DONE, 0);
+        return;
     }
-    
-    // ============================================================================
-    // PHASE 2: LOAD ALL WEIGHTS (256KB with dequantization)
-    // *** LOAD ONCE, REUSE FOREVER ***
-    // ============================================================================
-    load_all_wgt: for (int n_tile = 0; n_tile < NUM_N_TILES; ++n_tile) {
-        // #pragma HLS loop_tripcount min=32 max=32 avg=32
-        #pragma HLS loop_tripcount min=N_DIM/PE_COLS max=N_DIM/PE_COLS avg=N_DIM/PE_COLS
-        
-        load_wgt_tile: for (int idx = 0; idx < PE_COLS * K; ++idx) {
+
+    if (use_gemv(cmd, M, N)) {
+#if SA_WGT_TILE_MAJOR
+        // ============================================================================
+        // GEMV: one N-tile per channel at a time. Each word holds
+        // COLS_PER_WORD K-columns of the tile; their products are reduced
+        // over K and added to the tile's accumulators. Activation k sits in
+        // bank k % COLS_PER_WORD, so a word's activations come out together.
+        // Columns past K are zero weights in the host layout.
+        // ============================================================================
+        const int TILE_WORDS = wgt_tile_words(K);
+
+        recv_act_gemv: for (int k = 0; k < K; ++k) {
             #pragma HLS PIPELINE II=1
-            // #pragma HLS loop_tripcount min=8192 max=8192 avg=8192
-            #pragma HLS loop_tripcount min=PE_COLS*K_DIM max=PE_COLS*K_DIM avg=PE_COLS*K_DIM
-            
-            int j = idx / K;
-            int k = idx % K;
-            int n_idx = n_tile * PE_COLS + j;
-            int w_linear = k * N + n_idx;
-            
-            uint8_t packed_byte = weights_packed[w_linear / 2];
-            uint8_t scale_factor = scales[w_linear / GROUP_SIZE];
-            bool is_upper = (w_linear & 1);
-            
-            W_cache[n_tile][j][k] = unpack_dequantize_weight(
-                packed_byte, is_upper, scale_factor
-            );
-        }
-    }
-    
-    // ============================================================================
-    // PHASE 3: COMPUTE ALL TILES (everything on-chip now!)
-    // ============================================================================
-    m_loop: for (int m_tile = 0; m_tile < NUM_M_TILES; ++m_tile) {
-        // #pragma HLS loop_tripcount min=8 max=8 avg=8
-        #pragma HLS loop_tripcount min=M_DIM/PE_ROWS max=M_DIM/PE_ROWS avg=M_DIM/PE_ROWS
-        
-        n_loop: for (int n_tile = 0; n_tile < NUM_N_TILES; ++n_tile) {
-            // #pragma HLS loop_tripcount min=32 max=32 avg=32
-            #pragma HLS loop_tripcount min=N_DIM/PE_COLS max=N_DIM/PE_COLS avg=N_DIM/PE_COLS
-            
-            // ---- COPY TO WORKING BUFFERS ----
-            copy_to_work: for (int k = 0; k < K; ++k) {
+            #pragma HLS loop_tripcount min=K_DIM max=K_DIM avg=K_DIM
+
+            act_vec_t col = act_q.read();
+            A_cache[0][k % COLS_PER_WORD][k / COLS_PER_WORD] = col[0];
+        }
+        prof_mark(prof_q, PH_RECV_ACT, K);
+
+        gemv_tiles: for (int local_tile = 0; local_tile < wgt_shard_tiles(N); ++local_tile) {
+            #pragma HLS loop_tripcount min=N_DIM/PE_COLS/WGT_CHANNELS max=N_DIM/PE_COLS/WGT_CHANNELS avg=N_DIM/PE_COLS/WGT_CHANNELS
+
+            acc_t y[WGT_CHANNELS][PE_COLS];
+            #pragma HLS ARRAY_PARTITION variable=y complete dim=0
+            for (int c = 0; c < WGT_CHANNELS; ++c) {
+                #pragma HLS UNROLL
+                for (int j = 0; j < PE_COLS; ++j) {
+                    #pragma HLS UNROLL
+                    y[c][j] = 0;
+                }
+            }
+
+            gemv_k: for (int kw = 0; kw < TILE_WORDS; ++kw) {
                 #pragma HLS PIPELINE II=1
-                // #pragma HLS loop_tripcount min=512 max=512 avg=512
-                #pragma HLS loop_tripcount min=K_DIM max=K_DIM avg=K_DIM
-                
-                for (int i = 0; i < PE_ROWS; ++i) {
+                #pragma HLS loop_tripcount min=K_DIM/COLS_PER_WORD max=K_DIM/COLS_PER_WORD avg=K_DIM/COLS_PER_WORD
+
+                int8_t a[COLS_PER_WORD];
+                #pragma HLS ARRAY_PARTITION variable=a complete
+                for (int kk = 0; kk < COLS_PER_WORD; ++kk) {
                     #pragma HLS UNROLL
-                    A_work[i][k] = A_cache[m_tile][i][k];
+                    a[kk] = A_cache[0][kk][kw];
                 }
-                
-                for (int j = 0; j < PE_COLS; ++j) {
+
+                for (int c = 0; c < WGT_CHANNELS; ++c) {
                     #pragma HLS UNROLL
-                    W_work[j][k] = W_cache[n_tile][j][k];
+                    gemv_vec_t wv;
+                    dequant_pkt(gemv_raw_q[c].read(), wv);
+                    for (int j = 0; j < PE_COLS; j += 2) {
+                        #pragma HLS UNROLL
+                        acc_t sum0 = 0, sum1 = 0;
+                        for (int kk = 0; kk < COLS_PER_WORD; ++kk) {
+                            #pragma HLS UNROLL
+                            int32_t p0, p1;
+                            pe_mul2(a[kk], wv[kk * PE_COLS + j], wv[kk * PE_COLS + j + 1], p0, p1);
+                            sum0 += p0;
+                            sum1 += p1;
+                        }
+                        y[c][j] += sum0;
+                        y[c][j + 1] += sum1;
+                    }
                 }
             }
-            
-            // ---- INITIALIZE OUTPUT ----
-            for (int i = 0; i < PE_ROWS; ++i) {
+            prof_mark(prof_q, PH_MAC, TILE_WORDS);
+
+            // Global tile local_tile * WGT_CHANNELS + c, in order
+            write_gemv: for (int c = 0; c < WGT_CHANNELS; ++c) {
+                #pragma HLS PIPELINE II=1
+
+                if (local_tile * WGT_CHANNELS + c < num_tiles(N, PE_COLS)) {
+                    out_vec_t row;
+                    for (int j = 0; j < PE_COLS; ++j) {
+                        #pragma HLS UNROLL
+                        row[j] = wgt_fmt::finish(y[c][j]);
+                    }
+                    out_q.write(row);
+                }
+            }
+            prof_mark(prof_q, PH_WRITE, WGT_CHANNELS);
+        }
+#else
+        // ============================================================================
+        // GEMV: y[n] += a[k] * W[k][n], one word per channel per cycle
+        // Word w of channel c holds local tiles w*TILES_PER_WORD.. of that
+        // shard, i.e. global tiles (w*TILES_PER_WORD + o)*WGT_CHANNELS + c.
+        // ============================================================================
+        const int ROW_WORDS = wgt_shard_stride(N) / GEMV_LANES;
+
+        recv_act_gemv: for (int k = 0; k < K; ++k) {
+            #pragma HLS PIPELINE II=1
+            #pragma HLS loop_tripcount min=K_DIM max=K_DIM avg=K_DIM
+
+            act_vec_t col = act_q.read();
+            A_cache[0][k % PE_ROWS][k / PE_ROWS] = col[0];
+        }
+        prof_mark(prof_q, PH_RECV_ACT, K);
+
+        init_gemv: for (int w = 0; w < ROW_WORDS; ++w) {
+            #pragma HLS PIPELINE II=1
+            #pragma HLS loop_tripcount min=GEMV_MAX_WORDS max=GEMV_MAX_WORDS avg=GEMV_MAX_WORDS
+
+            for (int c = 0; c < WGT_CHANNELS; ++c) {
                 #pragma HLS UNROLL
-                for (int j = 0; j < PE_COLS; ++j) {
+                for (int l = 0; l < GEMV_LANES; ++l) {
                     #pragma HLS UNROLL
-                    C_work[i][j] = 0;
+                    Y_acc[w][c][l] = 0;
                 }
             }
-            
-            // ---- COMPUTE: 16×16 SYSTOLIC ARRAY ----
-            compute: for (int k = 0; k < K; ++k) {
+        }
+
+        gemv_k: for (int k = 0; k < K; ++k) {
+            #pragma HLS loop_tripcount min=K_DIM max=K_DIM avg=K_DIM
+
+            int8_t a = A_cache[0][k % PE_ROWS][k / PE_ROWS];
+            gemv_n: for (int w = 0; w < ROW_WORDS; ++w) {
                 #pragma HLS PIPELINE II=1
-                // #pragma HLS loop_tripcount min=512 max=512 avg=512
-                #pragma HLS loop_tripcount min=K_DIM max=K_DIM avg=K_DIM
-                #pragma HLS DEPENDENCE variable=C_work inter false
-                
-                for (int i = 0; i < PE_ROWS; ++i) {
+                #pragma HLS loop_tripcount min=GEMV_MAX_WORDS max=GEMV_MAX_WORDS avg=GEMV_MAX_WORDS
+                // Same word is revisited ROW_WORDS >= GEMV_MIN_WORDS cycles later
+                #pragma HLS DEPENDENCE variable=Y_acc inter false
+
+                for (int c = 0; c < WGT_CHANNELS; ++c) {
                     #pragma HLS UNROLL
-                    for (int j = 0; j < PE_COLS; ++j) {
+                    gemv_vec_t wv;
+                    dequant_pkt(gemv_raw_q[c].read(), wv);
+                    for (int l = 0; l < GEMV_LANES; l += 2) {
                         #pragma HLS UNROLL
-                        int8_t a = A_work[i][k];
-                        int8_t w = W_work[j][k];
-                        C_work[i][j] += (int32_t)a * (int32_t)w;
+                        int32_t p0, p1;
+                        pe_mul2(a, wv[l], wv[l + 1], p0, p1);
+                        Y_acc[w][c][l] += p0;
+                        Y_acc[w][c][l + 1] += p1;
                     }
                 }
             }
-            
-            // ---- WRITE OUTPUT ----
-            write_output: for (int idx = 0; idx < PE_ROWS * PE_COLS; ++idx) {
+        }
+        prof_mark(prof_q, PH_MAC, (K + 1) * ROW_WORDS);
+
+        // One N-tile of outputs per cycle
+        write_gemv: for (int tile = 0; tile < num_tiles(N, PE_COLS); ++tile) {
+            #pragma HLS PIPELINE II=1
+            #pragma HLS loop_tripcount min=GEMV_MAX_N/PE_COLS max=GEMV_MAX_N/PE_COLS avg=GEMV_MAX_N/PE_COLS
+
+            int local_tile = tile / WGT_CHANNELS;
+            int w = local_tile / TILES_PER_WORD;
+            int l = (local_tile % TILES_PER_WORD) * PE_COLS;
+            out_vec_t row;
+            for (int j = 0; j < PE_COLS; ++j) {
+                #pragma HLS UNROLL
+                row[j] = wgt_fmt::finish(Y_acc[w][tile % WGT_CHANNELS][l + j]);
+            }
+            out_q.write(row);
+        }
+        prof_mark(prof_q, PH_WRITE, num_tiles(N, PE_COLS));
+#endif
+        prof_mark(prof_q, PH_DONE, 0);
+        return;
+    }
+
+#if SA_K_SPLIT > 1
+    if (use_ksplit(cmd, M, K, N)) {
+        // ============================================================================
+        // K-SPLIT: deal the single M-tile's K-columns and every N-tile's
+        // weight words to the slices, word w of a tile (K-columns
+        // w*COLS_PER_WORD..) to slice w % K_SPLIT. Tiles are padded to whole
+        // rounds so every slice gets slice_cols(K) columns per tile.
+        // ============================================================================
+        const int TILE_WORDS = wgt_tile_words(K);
+        const int ROUND_WORDS = slice_cols(K) / COLS_PER_WORD * K_SPLIT;
+
+        scatter_act: for (int k = 0; k < ROUND_WORDS * COLS_PER_WORD; ++k) {
+            #pragma HLS PIPELINE II=1
+            #pragma HLS loop_tripcount min=K_DIM max=K_DIM avg=K_DIM
+
+            act_vec_t col;
+            for (int i = 0; i < PE_ROWS; ++i) {
+                #pragma HLS UNROLL
+                col[i] = 0;
+            }
+            if (k < K) col = act_q.read();
+            write_channel(slice_act_q, (k / COLS_PER_WORD) % K_SPLIT, col);
+        }
+        prof_mark(prof_q, PH_RECV_ACT, ROUND_WORDS * COLS_PER_WORD);
+
+        scatter_wgt: for (int idx = 0; idx < num_n_tiles(N) * ROUND_WORDS; ++idx) {
+            #pragma HLS PIPELINE II=1
+            #pragma HLS loop_tripcount min=N_DIM/PE_COLS*K_DIM/COLS_PER_WORD max=N_DIM/PE_COLS*K_DIM/COLS_PER_WORD avg=N_DIM/PE_COLS*K_DIM/COLS_PER_WORD
+
+            const int n_tile = idx / ROUND_WORDS;
+            const int w = idx % ROUND_WORDS;
+            gemv_raw_t raw;  // zero weights past the tile
+            for (int b = 0; b < GEMV_LANES / 2; ++b) {
+                #pragma HLS UNROLL
+                raw.packed_bytes[b] = 0;
+            }
+            for (int g = 0; g < GEMV_SCALES; ++g) {
+                #pragma HLS UNROLL
+                raw.scale_factors[g] = 0;
+            }
+            if (w < TILE_WORDS) raw = read_channel(gemv_raw_q, n_tile % WGT_CHANNELS);
+            write_channel(slice_wgt_q, w % K_SPLIT, raw);
+        }
+        prof_mark(prof_q, PH_RECV_WGT, num_n_tiles(N) * ROUND_WORDS);
+        prof_mark(prof_q, PH_DONE, 0);
+        return;
+    }
+#endif
+
+    const int NUM_M_TILES = num_tiles(M, PE_ROWS);
+    const int NUM_N_TILES = num_n_tiles(N);
+    const bool WGT_RESIDENT = (num_wgt_passes(M, K, N) == 1);
+    const bool STREAM_WGT = (cmd == CMD_RUN);  // CMD_COMPUTE: all tiles parked
+    const int NUM_CHUNKS = num_k_chunks(K);
+    const int GROUP_TILES = n_group_tiles(cmd, M, K, N);
+    const int NUM_GROUPS = num_tiles(NUM_N_TILES, GROUP_TILES);
+
+    int slot = 0;  // W_cache slot holding the current N-tile
+
+    m_block_loop: for (int m_base = 0; m_base < NUM_M_TILES; m_base += ACT_CACHE_SIZE) {
+        #pragma HLS loop_tripcount min=M_DIM/PE_ROWS/ACT_CACHE_SIZE max=M_DIM/PE_ROWS/ACT_CACHE_SIZE avg=M_DIM/PE_ROWS/ACT_CACHE_SIZE
+
+        const int block_tiles = (NUM_M_TILES - m_base < ACT_CACHE_SIZE) ? NUM_M_TILES - m_base : ACT_CACHE_SIZE;
+        const bool reload = STREAM_WGT && (!WGT_RESIDENT || m_base == 0);
+        if (!reload) slot = 0;
+
+        // ============================================================================
+        // N-GROUPS x K-CHUNKS: a single pass over all N-tiles unless
+        // K-streaming, which walks every K-chunk for each group of ACC_TILES
+        // N-tiles with the group's sums parked in C_acc between chunks
+        // ============================================================================
+        k_pass: for (int pass = 0; pass < NUM_GROUPS * NUM_CHUNKS; ++pass) {
+            #pragma HLS loop_tripcount min=1 max=1 avg=1
+
+            const int g_base = (pass / NUM_CHUNKS) * GROUP_TILES;
+            const int g_end = (NUM_N_TILES - g_base < GROUP_TILES) ? NUM_N_TILES : g_base + GROUP_TILES;
+            const int chunk = pass % NUM_CHUNKS;
+            const int KC = chunk_cols(K, chunk);
+
+            // ============================================================================
+            // PROLOGUE: receive this chunk of the block's activations (and
+            // the group's first weight tile unless the weights are resident)
+            // ============================================================================
+            recv_act: for (int idx = 0; idx < block_tiles * KC; ++idx) {
                 #pragma HLS PIPELINE II=1
-                // #pragma HLS loop_tripcount min=256 max=256 avg=256
-                #pragma HLS loop_tripcount min=PE_ROWS*PE_COLS max=PE_ROWS*PE_COLS avg=PE_ROWS*PE_COLS
-                
-                int i = idx / PE_COLS;
-                int j = idx % PE_COLS;
-                
-                int m_idx = m_tile * PE_ROWS + i;
-                int n_idx = n_tile * PE_COLS + j;
-                result[m_idx * N + n_idx] = C_work[i][j];
+                #pragma HLS loop_tripcount min=M_DIM/PE_ROWS*K_DIM max=M_DIM/PE_ROWS*K_DIM avg=M_DIM/PE_ROWS*K_DIM
+
+                int m_tile = idx / KC;
+                int k = idx % KC;
+                act_vec_t col = act_q.read();
+                for (int i = 0; i < PE_ROWS; ++i) {
+                    #pragma HLS UNROLL
+                    A_cache[m_tile][i][k] = col[i];
+                }
             }
+            prof_mark(prof_q, PH_RECV_ACT, block_tiles * KC);
+
+            // The group's first N-tile lives in channel 0
+    #if SA_WGT_SPARSE
+            const int FIRST_COLS = reload ? recv_wgt_index(wgt_idx_q, 0, slot) : 0;
+    #else
+            (void)wgt_idx_q;  // block index, sparse builds only
+            const int FIRST_COLS = reload ? KC : 0;
+    #endif
+            recv_wgt_first: for (int k = 0; k < FIRST_COLS; ++k) {
+                #pragma HLS PIPELINE II=1
+                #pragma HLS loop_tripcount min=K_DIM max=K_DIM avg=K_DIM
+
+                cache_wgt_col(slot, k, read_channel(wgt_raw_q, 0));
+            }
+            prof_mark(prof_q, PH_RECV_WGT, FIRST_COLS);
+
+            // ============================================================================
+            // STEADY STATE: multiply tile n_tile, prefetch tile n_tile+1 into the
+            // next W_cache slot (W_cache is a ring when N exceeds its capacity)
+            // ============================================================================
+            n_loop: for (int n_tile = g_base; n_tile < g_end; ++n_tile) {
+                #pragma HLS loop_tripcount min=N_DIM/PE_COLS max=N_DIM/PE_COLS avg=N_DIM/PE_COLS
+
+                const int next_slot = (slot + 1 == WGT_CACHE_SIZE) ? 0 : slot + 1;
+                const int next_ch = (n_tile + 1) % WGT_CHANNELS;
+                const bool prefetch = reload && n_tile + 1 < g_end;
+    #if SA_WGT_SPARSE
+                // Only the next tile's block count is waited for; its entries
+                // trickle in alongside the columns
+                const int TILE_COLS = W_nblk[slot] * SPARSE_BLOCK;
+                int fill_nblk = 0, fill_b = 0;
+                if (prefetch) {
+                    fill_nblk = read_channel(wgt_idx_q, next_ch);
+                    W_nblk[next_slot] = fill_nblk;
+                }
+                const int FILL_COLS = fill_nblk * SPARSE_BLOCK;
+    #else
+                const int TILE_COLS = KC;
+                const int FILL_COLS = KC;
+    #endif
+                int fill_k = prefetch ? 0 : FILL_COLS;  // FILL_COLS == nothing to prefetch
+
+                m_loop: for (int m_tile = 0; m_tile < block_tiles; ++m_tile) {
+                    #pragma HLS loop_tripcount min=M_DIM/PE_ROWS max=M_DIM/PE_ROWS avg=M_DIM/PE_ROWS
+
+                    // ---- INITIALIZE OUTPUT (or resume the previous chunk's sums) ----
+                    for (int i = 0; i < PE_ROWS; ++i) {
+                        #pragma HLS UNROLL
+                        for (int j = 0; j < PE_COLS; ++j) {
+                            #pragma HLS UNROLL
+                            C_work[i][j] = (chunk == 0) ? (acc_t)0 : C_acc[m_tile][n_tile - g_base][i][j];
+                        }
+                    }
+
+        #if SA_SYSTOLIC_MESH
+                    // ---- COMPUTE: SYSTOLIC PE MESH ----
+                    // Row i of A enters column 0 delayed by i cycles and column j of
+                    // W enters row 0 delayed by j cycles, so PE(i,j) sees k = t-i-j.
+                    // Each PE only talks to its neighbours; the last MAC lands in
+                    // PE(R-1,C-1) after K + PE_ROWS + MESH_COLS - 2 cycles. With
+                    // SA_DSP_PACK a PE holds the two columns 2j, 2j+1.
+                    (void)TILE_COLS;  // tiles are dense (KC columns) on the mesh
+                    for (int i = 0; i < PE_ROWS; ++i) {
+                        #pragma HLS UNROLL
+                        for (int j = 0; j < PE_COLS; ++j) {
+                            #pragma HLS UNROLL
+                            A_reg[i][j] = 0;
+                            W_reg[i][j] = 0;
+                        }
+                    }
+
+                    mesh: for (int t = 0; t < KC + PE_ROWS + MESH_COLS - 2; ++t) {
+                        #pragma HLS PIPELINE II=1
+                        #pragma HLS loop_tripcount min=K_DIM+PE_ROWS+MESH_COLS-2 max=K_DIM+PE_ROWS+MESH_COLS-2 avg=K_DIM+PE_ROWS+MESH_COLS-2
+                        #pragma HLS DEPENDENCE variable=C_work inter false
+                        #pragma HLS DEPENDENCE variable=W_cache inter false
+                        #pragma HLS DEPENDENCE variable=W_scale inter false
+
+                        // Walk PEs from the south-east corner so every PE reads its
+                        // neighbour's register before that neighbour overwrites it.
+                        for (int i = PE_ROWS - 1; i >= 0; --i) {
+                            #pragma HLS UNROLL
+                            for (int j = MESH_COLS - 1; j >= 0; --j) {
+                                #pragma HLS UNROLL
+                                int8_t a_west;
+                                wgt_t w_north[PE_PACK];
+                                if (j == 0) {
+                                    int k = t - i;
+                                    a_west = (k >= 0 && k < KC) ? A_cache[m_tile][i][k] : (int8_t)0;
+                                } else {
+                                    a_west = A_reg[i][j - 1];
+                                }
+                                for (int l = 0; l < PE_PACK; ++l) {
+                                    #pragma HLS UNROLL
+                                    const int col = j * PE_PACK + l;
+                                    if (i == 0) {
+                                        int k = t - j;
+                                        w_north[l] = (k >= 0 && k < KC) ? cached_wgt(slot, col, k) : (wgt_t)0;
+                                    } else {
+                                        w_north[l] = W_reg[i - 1][col];
+                                    }
+                                }
+        #if SA_DSP_PACK
+                                systolic_pe2(a_west, w_north[0], w_north[1], A_reg[i][j],
+                                             W_reg[i][2 * j], W_reg[i][2 * j + 1],
+                                             C_work[i][2 * j], C_work[i][2 * j + 1]);
+        #else
+                                systolic_pe(a_west, w_north[0], A_reg[i][j], W_reg[i][j], C_work[i][j]);
+        #endif
+                            }
+                        }
+
+                        wgt_raw_t raw;
+                        if (fill_k < FILL_COLS && try_read_channel(wgt_raw_q, next_ch, raw)) {
+                            cache_wgt_col(next_slot, fill_k, raw);
+                            ++fill_k;
+                        }
+                    }
+                    prof_mark(prof_q, PH_MAC, KC + PE_ROWS + MESH_COLS - 2);
+        #else
+                    // ---- COMPUTE: PE_ROWS×PE_COLS SYSTOLIC ARRAY ----
+                    // Operands come straight out of the partitioned cache banks:
+                    // bank i of A_cache and each W_cache/W_scale bank serve one
+                    // read per cycle. Column j is dequantized once and broadcast
+                    // down its PE column. Block-sparse tiles only hold their
+                    // nonzero blocks: column c pairs with activation
+                    // cached_k(slot, c).
+                    compute: for (int c = 0; c < TILE_COLS; ++c) {
+                        #pragma HLS PIPELINE II=1
+                        #pragma HLS loop_tripcount min=K_DIM max=K_DIM avg=K_DIM
+                        #pragma HLS DEPENDENCE variable=C_work inter false
+                        #pragma HLS DEPENDENCE variable=W_cache inter false
+                        #pragma HLS DEPENDENCE variable=W_scale inter false
+    #if SA_WGT_SPARSE
+                        #pragma HLS DEPENDENCE variable=W_blk inter false
+    #endif
+
+                        const int k = cached_k(slot, c);
+                        wgt_t w[PE_COLS];
+                        #pragma HLS ARRAY_PARTITION variable=w complete
+                        for (int j = 0; j < PE_COLS; ++j) {
+                            #pragma HLS UNROLL
+                            w[j] = cached_wgt(slot, j, c);
+                        }
+
+                        for (int i = 0; i < PE_ROWS; ++i) {
+                            #pragma HLS UNROLL
+                            for (int j = 0; j < PE_COLS; j += 2) {
+                                #pragma HLS UNROLL
+                                int8_t a = A_cache[m_tile][i][k];
+                                int32_t p0, p1;
+                                pe_mul2(a, w[j], w[j + 1], p0, p1);
+                                C_work[i][j] += p0;
+                                C_work[i][j + 1] += p1;
+                            }
+                        }
+
+                        wgt_raw_t raw;
+                        if (fill_k < FILL_COLS && try_read_channel(wgt_raw_q, next_ch, raw)) {
+                            cache_wgt_col(next_slot, fill_k, raw);
+                            ++fill_k;
+                        }
+    #if SA_WGT_SPARSE
+                        blk_idx_t blk;
+                        if (fill_b < fill_nblk && try_read_channel(wgt_idx_q, next_ch, blk)) {
+                            W_blk[next_slot][fill_b] = blk;
+                            ++fill_b;
+                        }
+    #endif
+                    }
+                    prof_mark(prof_q, PH_MAC, TILE_COLS);
+        #endif
+
+                    // ---- PARK THE SUMS until the next K-chunk ----
+                    if (chunk + 1 < NUM_CHUNKS) {
+                        for (int i = 0; i < PE_ROWS; ++i) {
+                            #pragma HLS UNROLL
+                            for (int j = 0; j < PE_COLS; ++j) {
+                                #pragma HLS UNROLL
+                                C_acc[m_tile][n_tile - g_base][i][j] = C_work[i][j];
+                            }
+                        }
+                        continue;
+                    }
+
+                    // ---- WRITE OUTPUT: one row per cycle, StoreResult drains it ----
+                    write_output: for (int i = 0; i < PE_ROWS; ++i) {
+                        #pragma HLS PIPELINE II=1
+
+                        out_vec_t row;
+                        for (int j = 0; j < PE_COLS; ++j) {
+                            #pragma HLS UNROLL
+                            row[j] = wgt_fmt::finish(C_work[i][j]);
+                        }
+                        out_q.write(row);
+                    }
+                    prof_mark(prof_q, PH_WRITE, PE_ROWS);
+                }
+
+                // ---- FINISH PREFETCH (only when upstream fell behind) ----
+                // The index goes first: LoadWgt sends it ahead of the columns
+    #if SA_WGT_SPARSE
+                drain_index: for (; fill_b < fill_nblk; ++fill_b) {
+                    #pragma HLS PIPELINE II=1
+                    #pragma HLS loop_tripcount min=0 max=SPARSE_MAX_BLOCKS avg=0
+
+                    W_blk[next_slot][fill_b] = read_channel(wgt_idx_q, next_ch);
+                }
+    #endif
+                const int drained = FILL_COLS - fill_k;
+                drain_prefetch: for (; fill_k < FILL_COLS; ++fill_k) {
+                    #pragma HLS PIPELINE II=1
+                    #pragma HLS loop_tripcount min=0 max=K_DIM avg=0
+
+                    cache_wgt_col(next_slot, fill_k, read_channel(wgt_raw_q, next_ch));
+                }
+                if (drained > 0) prof_mark(prof_q, PH_RECV_WGT, drained);
+
+                slot = next_slot;
+            }
+        }
+    }
+    prof_mark(prof_q, PH_DONE, 0);
+}
+
+#if SA_K_SPLIT > 1
+// ============================================================================
+// COMPUTE SLICE: one K-slice of a single-M-tile call. Receives its
+// slice_cols(K) activation columns once, then for every N-tile MACs its
+// weight words (COLS_PER_WORD K-columns each, one column per cycle) into
+// a partial tile for ReduceK. The caches are locals, not file-scope like
+// Compute's, so that every instance gets its own copy.
+// ============================================================================
+void ComputeSlice(
+    tapa::istream<act_vec_t>& act_q,
+    tapa::istream<gemv_raw_t>& wgt_q,
+    tapa::ostream<part_vec_t>& part_q,
+    int M, int K, int N, int cmd
+) {
+    if (!use_ksplit(cmd, M, K, N)) return;
+
+    int8_t A_slice[PE_ROWS][K_SLICE_DIM];
+    acc_t C_part[PE_ROWS][PE_COLS];
+    #pragma HLS ARRAY_PARTITION variable=A_slice complete dim=1
+    #pragma HLS ARRAY_PARTITION variable=C_part complete dim=0
+    #pragma HLS BIND_STORAGE variable=A_slice type=RAM_2P impl=BRAM
+
+    const int SLICE_COLS = slice_cols(K);
+
+    recv_act_slice: for (int k = 0; k < SLICE_COLS; ++k) {
+        #pragma HLS PIPELINE II=1
+        #pragma HLS loop_tripcount min=K_SLICE_DIM max=K_SLICE_DIM avg=K_SLICE_DIM
+
+        act_vec_t col = act_q.read();
+        for (int i = 0; i < PE_ROWS; ++i) {
+            #pragma HLS UNROLL
+            A_slice[i][k] = col[i];
         }
     }
+
+    slice_tiles: for (int n_tile = 0; n_tile < num_n_tiles(N); ++n_tile) {
+        #pragma HLS loop_tripcount min=N_DIM/PE_COLS max=N_DIM/PE_COLS avg=N_DIM/PE_COLS
+
+        for (int i = 0; i < PE_ROWS; ++i) {
+            #pragma HLS UNROLL
+            for (int j = 0; j < PE_COLS; ++j) {
+                #pragma HLS UNROLL
+                C_part[i][j] = 0;
+            }
+        }
+
+        gemv_vec_t wv;
+        slice_k: for (int k = 0; k < SLICE_COLS; ++k) {
+            #pragma HLS PIPELINE II=1
+            #pragma HLS loop_tripcount min=K_SLICE_DIM max=K_SLICE_DIM avg=K_SLICE_DIM
+            #pragma HLS DEPENDENCE variable=C_part inter false
+
+            const int kk = k % COLS_PER_WORD;
+            if (kk == 0) dequant_pkt(wgt_q.read(), wv);
+
+            for (int i = 0; i < PE_ROWS; ++i) {
+                #pragma HLS UNROLL
+                for (int j = 0; j < PE_COLS; j += 2) {
+                    #pragma HLS UNROLL
+                    int32_t p0, p1;
+                    pe_mul2(A_slice[i][k], wv[kk * PE_COLS + j], wv[kk * PE_COLS + j + 1], p0, p1);
+                    C_part[i][j] += p0;
+                    C_part[i][j + 1] += p1;
+                }
+            }
+        }
+
+        write_part: for (int i = 0; i < PE_ROWS; ++i) {
+            #pragma HLS PIPELINE II=1
+
+            part_vec_t row;
+            for (int j = 0; j < PE_COLS; ++j) {
+                #pragma HLS UNROLL
+                row[j] = C_part[i][j];
+            }
+            part_q.write(row);
+        }
+    }
+}
+
+// ============================================================================
+// REDUCE K: sum the slices' partial tile rows and round them; rows of every
+// other call pass through from Compute unchanged
+// ============================================================================
+void ReduceK(
+    tapa::istream<out_vec_t>& tile_q,
+    tapa::istreams<part_vec_t, K_SPLIT>& part_q,
+    tapa::ostream<out_vec_t>& out_q,
+    int M, int K, int N, int cmd
+) {
+    const bool SPLIT = use_ksplit(cmd, M, K, N);
+
+    reduce: for (int r = 0; r < num_out_rows(M, N, cmd); ++r) {
+        #pragma HLS PIPELINE II=1
+        #pragma HLS loop_tripcount min=M_DIM*N_DIM/PE_COLS max=M_DIM*N_DIM/PE_COLS avg=M_DIM*N_DIM/PE_COLS
+
+        out_vec_t row;
+        if (SPLIT) {
+            acc_t sum[PE_COLS];
+            #pragma HLS ARRAY_PARTITION variable=sum complete
+            for (int j = 0; j < PE_COLS; ++j) {
+                #pragma HLS UNROLL
+                sum[j] = 0;
+            }
+            for (int s = 0; s < K_SPLIT; ++s) {
+                #pragma HLS UNROLL
+                part_vec_t part = part_q[s].read();
+                for (int j = 0; j < PE_COLS; ++j) {
+                    #pragma HLS UNROLL
+                    sum[j] += part[j];
+                }
+            }
+            for (int j = 0; j < PE_COLS; ++j) {
+                #pragma HLS UNROLL
+                row[j] = wgt_fmt::finish(sum[j]);
+            }
+        } else {
+            row = tile_q.read();
+        }
+        out_q.write(row);
+    }
+}
+#endif
+
+// ============================================================================
+// EPILOGUE: bias, requantize and activation per finished row (epi != EPI_OFF),
+// so only int8 leaves the chip (or, with CHAIN_OUT, goes back to LoadAct);
+// with EPI_OFF rows pass through as int32
+// ============================================================================
+const int EPI_MAX_TILES = EPI_MAX_N / PE_COLS;
+
+static out_vec_t E_bias[EPI_MAX_TILES];
+static out_vec_t E_rq[EPI_MAX_TILES];
+
+void Epilogue(
+    tapa::istream<out_vec_t>& out_q,
+    tapa::mmap<out_vec_t> epilogue,
+    tapa::ostream<out_vec_t>& res_q,
+    tapa::ostream<q8_vec_t>& q8_q,
+    tapa::ostream<q8_vec_t>& chain_q,
+    tapa::ostream<prof_event_t>& prof_q,
+    int M, int N, int cmd, int epi, int chain
+) {
+    const int NUM_ROWS = num_out_rows(M, N, cmd);
+    const bool CHAIN = use_chain_out(cmd, M, N, epi, chain);
+
+    if (epi == EPI_OFF) {
+        pass: for (int r = 0; r < NUM_ROWS; ++r) {
+            #pragma HLS PIPELINE II=1
+            #pragma HLS loop_tripcount min=M_DIM*N_DIM/PE_COLS max=M_DIM*N_DIM/PE_COLS avg=M_DIM*N_DIM/PE_COLS
+            res_q.write(out_q.read());
+        }
+        prof_mark(prof_q, PH_APPLY, NUM_ROWS);
+        prof_mark(prof_q, PH_DONE, 0);
+        return;
+    }
+
+    // One copy of the table per lane so every lane looks up each cycle
+    int8_t lut[PE_COLS][256];
+    #pragma HLS ARRAY_PARTITION variable=lut dim=1 complete
+
+    load_lut: for (int w = 0; w < EPI_LUT_WORDS; ++w) {
+        out_vec_t word = epilogue[w];
+        for (int b = 0; b < 4 * PE_COLS; ++b) {
+            #pragma HLS PIPELINE II=1
+            const int8_t v = (int8_t)(word[b / 4] >> (8 * (b % 4)));
+            for (int j = 0; j < PE_COLS; ++j) {
+                #pragma HLS UNROLL
+                lut[j][w * 4 * PE_COLS + b] = v;
+            }
+        }
+    }
+
+    const int TILES = num_tiles(N, PE_COLS);
+    load_params: for (int t = 0; t < TILES && t < EPI_MAX_TILES; ++t) {
+        #pragma HLS PIPELINE II=2
+        #pragma HLS loop_tripcount min=1 max=N_DIM/PE_COLS avg=N_DIM/PE_COLS
+        E_bias[t] = epilogue[EPI_LUT_WORDS + 2 * t];
+        E_rq[t] = epilogue[EPI_LUT_WORDS + 2 * t + 1];
+    }
+    prof_mark(prof_q, PH_LOAD_PARAMS, 256 + 2 * TILES);
+
+    RowPos pos(M, N, cmd);
+    apply: for (int r = 0; r < NUM_ROWS; ++r) {
+        #pragma HLS PIPELINE II=1
+        #pragma HLS loop_tripcount min=M_DIM*N_DIM/PE_COLS max=M_DIM*N_DIM/PE_COLS avg=M_DIM*N_DIM/PE_COLS
+
+        // Padding tiles past N are dropped by StoreQ8; any parameters do
+        const int t = (pos.n_tile < TILES && pos.n_tile < EPI_MAX_TILES) ? pos.n_tile : 0;
+        const out_vec_t bias = E_bias[t];
+        const out_vec_t rq = E_rq[t];
+        out_vec_t row = out_q.read();
+
+        q8_vec_t q;
+        for (int j = 0; j < PE_COLS; ++j) {
+            #pragma HLS UNROLL
+            q[j] = epilogue_apply(row[j], bias[j], rq[j], epi, lut[j]);
+        }
+        if (CHAIN) {
+            chain_q.write(q);
+        } else {
+            q8_q.write(q);
+        }
+        pos.next();
+    }
+    prof_mark(prof_q, PH_APPLY, NUM_ROWS);
+    prof_mark(prof_q, PH_DONE, 0);
+}
+
+// ============================================================================
+// STORE: drain finished tile rows as wide writes, dropping the zero-padded
+// rows/tiles past M and N. Writes are issued through async_mmap so many stay
+// in flight while Compute works on the next tile. StoreResult takes the
+// int32 rows, StoreQ8 the int8 rows of the epilogue; only one is active.
+// ============================================================================
+template <typename T>
+static void store_rows(
+    tapa::istream<T>& row_q,
+    tapa::async_mmap<T>& result,
+    tapa::ostream<prof_event_t>& prof_q,
+    int M, int N, int cmd
+) {
+    const int ROW_WORDS = out_row_stride(N) / PE_COLS;
+    const int NUM_ROWS = num_out_rows(M, N, cmd);
+    const int NUM_WRITES = M * ROW_WORDS;
+
+    RowPos pos(M, N, cmd);  // of the next row from row_q
+
+    store: for (int rd = 0, wr_resp = 0; rd < NUM_ROWS || wr_resp < NUM_WRITES;) {
+        #pragma HLS PIPELINE II=1
+        #pragma HLS loop_tripcount min=M_DIM*N_DIM/PE_COLS max=M_DIM*N_DIM/PE_COLS avg=M_DIM*N_DIM/PE_COLS
+
+        const int m_idx = pos.m_idx();
+        const bool valid = m_idx < M && pos.n_tile < ROW_WORDS;
+
+        if (rd < NUM_ROWS && !row_q.empty() &&
+            (!valid || (!result.write_addr.full() && !result.write_data.full()))) {
+            T row = row_q.read();
+            if (valid) {
+                result.write_addr.write(m_idx * ROW_WORDS + pos.n_tile);
+                result.write_data.write(row);
+            }
+            ++rd;
+            pos.next();
+        }
+
+        uint8_t n_resp;
+        if (result.write_resp.try_read(n_resp)) wr_resp += int(n_resp) + 1;
+    }
+    prof_mark(prof_q, PH_STORE, NUM_ROWS);
+}
+
+void StoreResult(
+    tapa::istream<out_vec_t>& res_q,
+    tapa::async_mmap<out_vec_t>& result,
+    tapa::ostream<prof_event_t>& prof_q,
+    int M, int N, int cmd, int epi
+) {
+    if (cmd != CMD_LOAD_WGT && epi == EPI_OFF) store_rows(res_q, result, prof_q, M, N, cmd);
+    prof_mark(prof_q, PH_DONE, 0);
+}
+
+void StoreQ8(
+    tapa::istream<q8_vec_t>& q8_q,
+    tapa::async_mmap<q8_vec_t>& result_q8,
+    tapa::ostream<prof_event_t>& prof_q,
+    int M, int N, int cmd, int epi, int chain
+) {
+    if (cmd != CMD_LOAD_WGT && epi != EPI_OFF && !use_chain_out(cmd, M, N, epi, chain)) {
+        store_rows(q8_q, result_q8, prof_q, M, N, cmd);
+    }
+    prof_mark(prof_q, PH_DONE, 0);
+}
+
+// ============================================================================
+// PROFILER (SA_PROFILE): a free-running cycle counter. Each cycle it takes
+// at most one event per task and charges the cycles since that task's
+// previous event to the phase the event closes.
+// ============================================================================
+static void prof_poll(
+    tapa::istream<prof_event_t>& prof_q,
+    int task, uint64_t now,
+    uint64_t cycles[PROF_TASKS][PROF_PHASES],
+    uint64_t iters[PROF_TASKS][PROF_PHASES],
+    uint64_t last[PROF_TASKS],
+    bool done[PROF_TASKS]
+) {
+    #pragma HLS INLINE
+    prof_event_t ev;
+    if (!done[task] && prof_q.try_read(ev)) {
+        const int phase = (int)(ev >> 32);
+        if (phase == PH_DONE) {
+            done[task] = true;
+        } else if (phase < PROF_PHASES) {
+            cycles[task][phase] += now - last[task];
+            iters[task][phase] += (uint32_t)ev;
+        }
+        last[task] = now;
+    }
+}
+
+void Profiler(
+    tapa::istream<prof_event_t>& act_prof_q,
+    tapa::istreams<prof_event_t, WGT_CHANNELS>& wgt_prof_q,
+    tapa::istream<prof_event_t>& compute_prof_q,
+    tapa::istream<prof_event_t>& epi_prof_q,
+    tapa::istream<prof_event_t>& store_prof_q,
+    tapa::istream<prof_event_t>& q8_prof_q,
+    tapa::mmap<uint64_t> stats
+) {
+    if (!PROFILE) return;
+
+    uint64_t cycles[PROF_TASKS][PROF_PHASES];
+    uint64_t iters[PROF_TASKS][PROF_PHASES];
+    uint64_t last[PROF_TASKS];
+    bool done[PROF_TASKS];
+    #pragma HLS ARRAY_PARTITION variable=cycles complete dim=0
+    #pragma HLS ARRAY_PARTITION variable=iters complete dim=0
+    #pragma HLS ARRAY_PARTITION variable=last complete
+    #pragma HLS ARRAY_PARTITION variable=done complete
+
+    for (int t = 0; t < PROF_TASKS; ++t) {
+        #pragma HLS UNROLL
+        for (int p = 0; p < PROF_PHASES; ++p) {
+            #pragma HLS UNROLL
+            cycles[t][p] = 0;
+            iters[t][p] = 0;
+        }
+        last[t] = 0;
+        done[t] = false;
+    }
+
+    uint64_t now = 0;
+    count: for (bool busy = true; busy; ++now) {
+        #pragma HLS PIPELINE II=1
+        #pragma HLS loop_tripcount min=M_DIM*N_DIM/PE_COLS max=M_DIM*N_DIM*K_DIM/PE_ROWS/PE_COLS avg=M_DIM*N_DIM*K_DIM/PE_ROWS/PE_COLS
+
+        prof_poll(act_prof_q, PROF_LOAD_ACT, now, cycles, iters, last, done);
+        for (int c = 0; c < WGT_CHANNELS; ++c) {
+            #pragma HLS UNROLL
+            prof_poll(wgt_prof_q[c], PROF_LOAD_WGT + c, now, cycles, iters, last, done);
+        }
+        prof_poll(compute_prof_q, PROF_COMPUTE, now, cycles, iters, last, done);
+        prof_poll(epi_prof_q, PROF_EPILOGUE, now, cycles, iters, last, done);
+        prof_poll(store_prof_q, PROF_STORE, now, cycles, iters, last, done);
+        prof_poll(q8_prof_q, PROF_STORE_Q8, now, cycles, iters, last, done);
+
+        busy = false;
+        for (int t = 0; t < PROF_TASKS; ++t) {
+            #pragma HLS UNROLL
+            if (!done[t]) busy = true;
+        }
+    }
+
+    stats[0] = now;
+    stats[1] = PROF_TASKS;
+    write_stats: for (int t = 0; t < PROF_TASKS; ++t) {
+        for (int p = 0; p < PROF_PHASES; ++p) {
+            #pragma HLS PIPELINE II=2
+            stats[prof_index(t, p)] = cycles[t][p];
+            stats[prof_index(t, p) + 1] = iters[t][p];
+        }
+    }
+}
+
+// ============================================================================
+// TOP
+// ============================================================================
+void SystolicArrayKernel(
+    tapa::mmap<act_word_t> activations,
+    tapa::mmaps<byte_word_t, WGT_CHANNELS> weights_packed,
+    tapa::mmaps<byte_word_t, WGT_CHANNELS> scales,
+    tapa::mmap<out_vec_t> epilogue,
+    tapa::mmap<out_vec_t> result,
+    tapa::mmap<q8_vec_t> result_q8,
+    int M, int K, int N,
+    int cmd,
+    int epi,
+    int chain,
+    tapa::mmap<uint64_t> stats
+) {
+    tapa::stream<act_vec_t, 32> act_q("act_q");
+    tapa::streams<wgt_raw_t, WGT_CHANNELS, 32> wgt_raw_q("wgt_raw_q");
+    tapa::streams<gemv_raw_t, WGT_CHANNELS, 32> gemv_raw_q("gemv_raw_q");
+    tapa::streams<blk_idx_t, WGT_CHANNELS, 32> wgt_idx_q("wgt_idx_q");
+    tapa::stream<out_vec_t, 2 * PE_ROWS> out_q("out_q");  // one tile in flight
+    tapa::stream<out_vec_t, 2 * PE_ROWS> res_q("res_q");
+    tapa::stream<q8_vec_t, 2 * PE_ROWS> q8_q("q8_q");
+    tapa::stream<q8_vec_t, 2 * PE_ROWS> chain_q("chain_q");
+    tapa::stream<prof_event_t, 16> act_prof_q("act_prof_q");
+    tapa::streams<prof_event_t, WGT_CHANNELS, 16> wgt_prof_q("wgt_prof_q");
+    tapa::stream<prof_event_t, 16> compute_prof_q("compute_prof_q");
+    tapa::stream<prof_event_t, 16> epi_prof_q("epi_prof_q");
+    tapa::stream<prof_event_t, 16> store_prof_q("store_prof_q");
+    tapa::stream<prof_event_t, 16> q8_prof_q("q8_prof_q");
+#if SA_K_SPLIT > 1
+    tapa::streams<act_vec_t, K_SPLIT, 32> slice_act_q("slice_act_q");
+    tapa::streams<gemv_raw_t, K_SPLIT, 8> slice_wgt_q("slice_wgt_q");
+    tapa::streams<part_vec_t, K_SPLIT, 2 * PE_ROWS> part_q("part_q");
+    tapa::stream<out_vec_t, 2 * PE_ROWS> tile_q("tile_q");    // Compute -> ReduceK
+#endif
+
+    tapa::task()
+        .invoke(LoadAct, activations, act_q, chain_q, act_prof_q, M, K, N, cmd, epi, chain)
+        .invoke<tapa::join, WGT_CHANNELS>(LoadWgt, weights_packed, scales, wgt_raw_q, gemv_raw_q, wgt_idx_q, wgt_prof_q, M, K, N, cmd)
+#if SA_K_SPLIT > 1
+        .invoke(Compute, act_q, wgt_raw_q, gemv_raw_q, wgt_idx_q, tile_q, slice_act_q, slice_wgt_q, compute_prof_q, M, K, N, cmd)
+        .invoke<tapa::join, K_SPLIT>(ComputeSlice, slice_act_q, slice_wgt_q, part_q, M, K, N, cmd)
+        .invoke(ReduceK, tile_q, part_q, out_q, M, K, N, cmd)
+#else
+        .invoke(Compute, act_q, wgt_raw_q, gemv_raw_q, wgt_idx_q, out_q, compute_prof_q, M, K, N, cmd)
+#endif
+        .invoke(Epilogue, out_q, epilogue, res_q, q8_q, chain_q, epi_prof_q, M, N, cmd, epi, chain)
+        .invoke(StoreResult, res_q, result, store_prof_q, M, N, cmd, epi)
+        .invoke(StoreQ8, q8_q, result_q8, q8_prof_q, M, N, cmd, epi, chain)
+        .invoke(Profiler, act_prof_q, wgt_prof_q, compute_prof_q, epi_prof_q, store_prof_q, q8_prof_q, stats);
 }
@@ -2,40 +2,804 @@
 #define SA_H_
 
 #include <tapa.h>
+#include <ap_int.h>
 #include <cstdint>
+#include <type_traits>
 
+// K_DIM is the K depth of the on-chip caches (make K_DIM=<k>); a call's K
+// may go up to K_MAX (below), longer reductions stream through the caches
+// in chunks of K_DIM (see K-streaming)
+#ifndef SA_K_DIM
+#define SA_K_DIM 4096
+#endif
 const int M_DIM = 128;
-const int K_DIM = 4096;
+const int K_DIM = SA_K_DIM;
 const int N_DIM = 512;
 
-const int PE_ROWS = 16;
-const int PE_COLS = 16;
-const int GROUP_SIZE = 16;
+// Array geometry, chosen at build time (make PE_ROWS=32 PE_COLS=16, or
+// make dse to sweep several): PE_ROWS rows of an M-tile by PE_COLS columns
+// of an N-tile, one MAC per PE per cycle. PE_COLS must divide the 128
+// nibbles of a weight word; the cache depths below follow the geometry so
+// that the on-chip capacity in rows/columns stays the same.
+#ifndef SA_PE_ROWS
+#define SA_PE_ROWS 16
+#endif
+#ifndef SA_PE_COLS
+#define SA_PE_COLS 16
+#endif
+const int PE_ROWS = SA_PE_ROWS;
+const int PE_COLS = SA_PE_COLS;
+static_assert(PE_ROWS >= 1 && PE_COLS >= 2 && PE_COLS % 2 == 0, "PE_COLS holds whole packed bytes");
+
+// Longest K of a call (make K_MAX=<k>), at most K_DIM * 128 / PE_COLS: a
+// GEMV call keeps all of its activations on chip. Block-sparse builds
+// stay at K_DIM.
+#ifndef SA_K_MAX
+#if SA_WGT_SPARSE
+#define SA_K_MAX SA_K_DIM
+#else
+#define SA_K_MAX 16384
+#endif
+#endif
+const int K_MAX = (SA_K_MAX < K_DIM * (128 / PE_COLS)) ? SA_K_MAX : K_DIM * (128 / PE_COLS);
+static_assert(K_DIM % 64 == 0 && K_MAX >= K_DIM, "K-chunks are whole activation words");
+
+constexpr int ceil_log2(int x) {
+    return (x > 1) ? 1 + ceil_log2((x + 1) / 2) : 0;
+}
+const int LOG2_K_MAX = ceil_log2(K_MAX);
+
+// Compute engine, chosen at build time (make ENGINE=mesh):
+//   0 - broadcast MAC loop, every operand fans out to a full row/column
+//   1 - systolic PE mesh, operands forwarded east/south through registers
+#ifndef SA_SYSTOLIC_MESH
+#define SA_SYSTOLIC_MESH 0
+#endif
+
+// DSP packing, chosen at build time (make DSP_PACK=1): the two weights of
+// neighbouring columns share one multiplier and the activation (pe_mul2),
+// halving the DSPs of the array and the GEMV lanes. Needs 8-bit PE weights.
+#ifndef SA_DSP_PACK
+#define SA_DSP_PACK 0
+#endif
+
+// ---- MXINT4 weight format ----
+// Weights are 4-bit two's complement nibbles; each group of GROUP weights
+// shares one exponent byte. Groups run along one axis of the K x N matrix:
+//   GROUP_ALONG_N - consecutive weights of a K-row (the flat row-major index)
+//   GROUP_ALONG_K - consecutive K-rows of one column (OCP MX blocks)
+// and exponents are EXP_BITS wide:
+//   2 - shift s in [0, 3], weight w4 << 2s truncated to int8 (original format)
+//   8 - E8M0, weight w4 * 2^(e - 127). The integer datapath keeps
+//       SA_WGT_FRAC_BITS fraction bits: weights enter the array as
+//       w4 << (e - 127 + SA_WGT_FRAC_BITS) with e - 127 clamped to
+//       [-SA_WGT_FRAC_BITS, SA_WGT_MAX_EXP], and results are rounded back
+//       to integers as they leave it.
+// The accumulator is as wide as K_MAX of the largest products need.
+// Chosen at build time (make WGT_FORMAT=mx: E8M0 blocks of 32 along K).
+const int GROUP_ALONG_N = 0;
+const int GROUP_ALONG_K = 1;
+
+#ifndef SA_GROUP_SIZE
+#define SA_GROUP_SIZE 16
+#endif
+#ifndef SA_GROUP_AXIS
+#define SA_GROUP_AXIS 0  // GROUP_ALONG_N
+#endif
+#ifndef SA_EXP_BITS
+#define SA_EXP_BITS 2
+#endif
+#ifndef SA_WGT_FRAC_BITS
+#define SA_WGT_FRAC_BITS 8
+#endif
+#ifndef SA_WGT_MAX_EXP
+#define SA_WGT_MAX_EXP 0
+#endif
+
+template <int GROUP, int AXIS, int EXP_BITS>
+struct mx_format {
+    static_assert(EXP_BITS == 2 || EXP_BITS == 8, "exponents are 2-bit shifts or E8M0");
+    static_assert(AXIS == GROUP_ALONG_N || AXIS == GROUP_ALONG_K, "unknown group axis");
+
+    static const int group_size = GROUP;
+    static const int exp_bits = EXP_BITS;
+    static const bool along_k = (AXIS == GROUP_ALONG_K);
+
+    // Exponents per K-column of an N-tile, and K-columns sharing them
+    static const int col_scales = along_k ? PE_COLS : PE_COLS / GROUP;
+    static const int k_group = along_k ? GROUP : 1;
+
+    // Range of the weight exponent (E8M0: e - exp_bias; 2-bit: 2s)
+    static const int exp_bias = (EXP_BITS == 8) ? 127 : 0;
+    static const int frac_bits = (EXP_BITS == 8) ? SA_WGT_FRAC_BITS : 0;
+    static const int min_exp = -frac_bits;
+    static const int max_exp = (EXP_BITS == 8) ? SA_WGT_MAX_EXP : 6;
+    static const int max_shift = max_exp + frac_bits;
+
+    // Weight entering a PE, and the accumulator (|a| <= 2^7, |w4| <= 2^3)
+    typedef typename std::conditional<EXP_BITS == 2, int8_t, int16_t>::type wgt_t;
+    static const int acc_bits = 1 + 7 + 3 + max_shift + LOG2_K_MAX;
+    typedef typename std::conditional<acc_bits <= 32, int32_t, int64_t>::type acc_t;
+
+    // Left shift of w4 in the integer datapath for exponent byte e
+    static int shift(uint8_t e) {
+        #pragma HLS INLINE
+        if (EXP_BITS == 2) return (e & 0x3) * 2;
+        int s = (int)e - exp_bias + frac_bits;
+        return (s < 0) ? 0 : (s > max_shift) ? max_shift : s;
+    }
+
+    static wgt_t dequant(uint8_t packed_byte, bool is_upper, uint8_t e) {
+        #pragma HLS INLINE
+        int8_t w_4bit = is_upper ? ((packed_byte >> 4) & 0x0F) : (packed_byte & 0x0F);
+        if (w_4bit & 0x08) w_4bit |= 0xF0;
+        return w_4bit << shift(e);
+    }
+
+    // Exponent of lane l of a packet (lanes run along N across an N-tile,
+    // then on to the next K-column)
+    static int lane_scale(int l) {
+        #pragma HLS INLINE
+        return along_k ? l % PE_COLS : l / GROUP;
+    }
+
+    // Integer result of a finished sum, rounded half up
+    static int32_t finish(acc_t acc) {
+        #pragma HLS INLINE
+        return (int32_t)((acc + (((acc_t)1 << frac_bits) >> 1)) >> frac_bits);
+    }
+};
+
+typedef mx_format<SA_GROUP_SIZE, SA_GROUP_AXIS, SA_EXP_BITS> wgt_fmt;
+typedef wgt_fmt::wgt_t wgt_t;
+typedef wgt_fmt::acc_t acc_t;
+const int GROUP_SIZE = wgt_fmt::group_size;
+const int COL_SCALES = wgt_fmt::col_scales;  // exponents per K-column of an N-tile
+const int K_GROUP = wgt_fmt::k_group;        // K-columns sharing them
+static_assert(!SA_DSP_PACK || sizeof(wgt_t) == 1, "DSP packing needs 8-bit PE weights (WGT_FORMAT=shift)");
+
+// On-chip capacity (K up to K_DIM per row/column)
+// Activation cache: M_DIM / PE_ROWS M-tiles = one M-block of 128 rows
+//                   (512KB at K_DIM)
+// Weight cache:     1024 / PE_COLS N-tiles = 1024 columns kept as MXINT4
+//                   nibbles plus group scales, ring-buffered (2.25MB at K_DIM)
+#ifndef SA_ACT_CACHE_SIZE
+#define SA_ACT_CACHE_SIZE (M_DIM / SA_PE_ROWS)
+#endif
+#ifndef SA_WGT_CACHE_SIZE
+#define SA_WGT_CACHE_SIZE (1024 / SA_PE_COLS)
+#endif
+const int ACT_CACHE_SIZE = SA_ACT_CACHE_SIZE;  // M-tiles per M-block
+const int WGT_CACHE_SIZE = SA_WGT_CACHE_SIZE;  // N-tile slots in W_cache
+static_assert(ACT_CACHE_SIZE >= 1 && WGT_CACHE_SIZE >= 2, "W_cache double-buffers N-tiles");
+
+// ---- AXI data layout ----
+// Every mmap is read in 512-bit words. Host buffers pad rows to whole words
+// so a row never straddles a word boundary:
+//   activations  M x act_row_stride(K)   int8 (see Activation format)
+//   weights      K x wgt_row_stride(N)   MXINT4, two nibbles per byte
+//   scales       one exponent per group of the padded weight matrix
+//                (scale_index), padded to whole words
+//   result       M x out_row_stride(N)   int32, written one tile row
+//                (PE_COLS results) per word
+// The kernel reads the weights/scales split into HBM shards (see below).
+const int AXI_BYTES = 64;
+typedef tapa::vec_t<int8_t, AXI_BYTES> act_word_t;
+typedef tapa::vec_t<uint8_t, AXI_BYTES> byte_word_t;
+
+// Stream payloads between the load / compute / store tasks
+typedef tapa::vec_t<int8_t, PE_ROWS> act_vec_t;  // one K-column of an M-tile
+typedef tapa::vec_t<int32_t, PE_COLS> out_vec_t; // one row of a finished C tile
+static_assert(2 * AXI_BYTES % PE_COLS == 0, "N-tiles must pack evenly into weight words");
+static_assert(sizeof(int32_t) * PE_COLS <= 2 * AXI_BYTES, "a result word is at most 1024 bits");
+
+// LANES MXINT4 weights: LANES/2 packed bytes (even lane in the low nibble)
+// and the SCALES exponents they use (wgt_fmt::lane_scale)
+template <int LANES, int SCALES>
+struct mxint4_pkt_t {
+    tapa::vec_t<uint8_t, LANES / 2> packed_bytes;
+    tapa::vec_t<uint8_t, SCALES> scale_factors;
+};
+
+typedef mxint4_pkt_t<PE_COLS, COL_SCALES> wgt_raw_t;  // one K-column of an N-tile
+static_assert(wgt_fmt::along_k || PE_COLS % GROUP_SIZE == 0, "N-tiles must hold whole scale groups");
+
+// ---- HBM weight sharding ----
+// weights_packed and scales are split over WGT_CHANNELS pseudo-channels by
+// N-tile: tile t lives in channel t % WGT_CHANNELS as local tile
+// t / WGT_CHANNELS. Every shard holds the same number of local tiles plus
+// its own scales, so all channels run the same loops in lock step.
+// config/hbm_u55c.cfg binds each port to its own bank; keep the two in sync.
+#ifndef SA_WGT_CHANNELS
+#define SA_WGT_CHANNELS 8
+#endif
+const int WGT_CHANNELS = SA_WGT_CHANNELS;
+const int TILES_PER_WORD = 2 * AXI_BYTES / PE_COLS;  // N-tile columns per word
+
+// Shard layout, chosen at build time (make WGT_LAYOUT=row):
+//   1 - tile-major: each local tile is K contiguous K-columns (PE_COLS/2
+//       bytes and COL_SCALES exponents per K_GROUP columns), tiles word
+//       aligned, so
+//       the loaders walk the shard in address order and fetch every weight
+//       and scale word exactly once
+//   0 - row-major: a K x wgt_shard_stride(N) matrix (rows padded to whole
+//       words); a K-column fetch uses PE_COLS/2 bytes of its word
+#ifndef SA_WGT_TILE_MAJOR
+#define SA_WGT_TILE_MAJOR 1
+#endif
+const int COL_BYTES = PE_COLS / 2;                // one K-column of an N-tile
+const int COLS_PER_WORD = AXI_BYTES / COL_BYTES;  // tile-major
+static_assert(AXI_BYTES % COL_BYTES == 0 && AXI_BYTES % COL_SCALES == 0,
+              "K-columns must not straddle words");
+static_assert(!wgt_fmt::along_k || (SA_WGT_TILE_MAJOR && GROUP_SIZE % COLS_PER_WORD == 0),
+              "groups along K need tile-major shards and whole words per group");
+
+// ---- GEMV (M=1) decode path ----
+// Every channel streams its whole shard in address order, one 512-bit word
+// (GEMV_LANES nibbles) per cycle, and each word is dequantized in one cycle.
+// Tile-major: a word is COLS_PER_WORD K-columns of one N-tile; its products
+// are summed over K and added to that tile's accumulators, so a tile row is
+// finished every wgt_tile_words(K) cycles and N is unbounded.
+// Row-major: a word is GEMV_LANES columns of one K-row, MAC'd against the
+// broadcast activation into an on-chip accumulator per output column.
+const int GEMV_LANES = 2 * AXI_BYTES;
+static_assert(!SA_WGT_TILE_MAJOR || GEMV_LANES == COLS_PER_WORD * PE_COLS,
+              "a tile-major GEMV word is COLS_PER_WORD whole K-columns");
+static_assert(COLS_PER_WORD <= PE_ROWS, "GEMV activations are banked over A_cache rows");
+static_assert(K_MAX <= K_DIM * COLS_PER_WORD, "a GEMV call keeps all K activations on chip");
+const int GEMV_MAX_N = 16384;    // output accumulators kept on chip (row-major)
+const int GEMV_MIN_WORDS = 4;    // accumulator RAW distance >= add latency
+const int GEMV_MAX_WORDS = GEMV_MAX_N / (GEMV_LANES * WGT_CHANNELS);
+
+// Exponents per GEMV word: one per column of its N-tile when groups run
+// along K (a word never crosses a group), else one per group in the word
+const int GEMV_SCALES = wgt_fmt::along_k ? PE_COLS : GEMV_LANES / GROUP_SIZE;
+
+typedef tapa::vec_t<wgt_t, GEMV_LANES> gemv_vec_t;
+typedef mxint4_pkt_t<GEMV_LANES, GEMV_SCALES> gemv_raw_t;
+
+// ---- Runtime shape helpers (shared by every task and the host) ----
+inline int num_tiles(int dim, int tile) {
+    #pragma HLS INLINE
+    return (dim + tile - 1) / tile;
+}
+
+inline int round_up(int dim, int align) {
+    #pragma HLS INLINE
+    return num_tiles(dim, align) * align;
+}
+
+inline int act_row_stride(int K) {
+    #pragma HLS INLINE
+    return round_up(K, AXI_BYTES);
+}
+
+// ---- Activation format ----
+// By default the activation port carries the int8 rows above. With
+// SA_ACT_INT4 (make ACT_FORMAT=int4) invoke_kernel sends them block-exponent
+// compressed, about half the bytes: each ACT_BLOCK K-values of a row share
+// a shift e in [0, ACT_MAX_SHIFT] and keep 4-bit mantissas, a = q * 2^e
+// with q in [-8, 7]. The port holds M rows of act_row_words(K) mantissa
+// words (even k in the low nibble), then M rows of act_exp_row_words(K)
+// words of exponent bytes. LoadAct expands every column back to int8, so
+// nothing past it changes; values off that grid are rounded on the host
+// (round_activations).
+#ifndef SA_ACT_INT4
+#define SA_ACT_INT4 0
+#endif
+const int ACT_BLOCK = 32;
+const int ACT_MAX_SHIFT = 4;
+const int ACT_PER_WORD = SA_ACT_INT4 ? 2 * AXI_BYTES : AXI_BYTES;   // K-values per activation word
+const int ACT_WORDS_PER_EXP = AXI_BYTES * ACT_BLOCK / ACT_PER_WORD;  // activation words per exponent word
+
+inline int act_row_words(int K) {
+    #pragma HLS INLINE
+    return num_tiles(K, ACT_PER_WORD);
+}
+
+inline int act_exp_row_words(int K) {
+    #pragma HLS INLINE
+    return SA_ACT_INT4 ? num_tiles(num_tiles(K, ACT_BLOCK), AXI_BYTES) : 0;
+}
+
+// Bytes the activation port of an M x K call reads
+inline int64_t act_port_bytes(int M, int K) {
+    #pragma HLS INLINE
+    return (int64_t)M * (act_row_words(K) + act_exp_row_words(K)) * AXI_BYTES;
+}
+
+inline int wgt_row_stride(int N) {
+    #pragma HLS INLINE
+    return round_up(N, 2 * AXI_BYTES);
+}
+
+// Exponent of weight (k, n) of a row-major matrix with rows of n_stride
+// weights, and the number of exponents of K such rows
+inline int scale_index(int k, int n, int n_stride) {
+    #pragma HLS INLINE
+    return wgt_fmt::along_k ? (k / GROUP_SIZE) * n_stride + n : (k * n_stride + n) / GROUP_SIZE;
+}
+
+inline int num_scales(int K, int n_stride) {
+    #pragma HLS INLINE
+    return wgt_fmt::along_k ? num_tiles(K, GROUP_SIZE) * n_stride : num_tiles(K * n_stride, GROUP_SIZE);
+}
+
+inline int out_row_stride(int N) {
+    #pragma HLS INLINE
+    return round_up(N, PE_COLS);
+}
+
+// Local N-tiles per HBM shard; the array walks WGT_CHANNELS times as many
+// (at most WGT_CHANNELS - 1 of them are zero padding)
+inline int wgt_shard_tiles(int N) {
+    #pragma HLS INLINE
+    return num_tiles(num_tiles(N, PE_COLS), WGT_CHANNELS);
+}
+
+inline int num_n_tiles(int N) {
+    #pragma HLS INLINE
+    return wgt_shard_tiles(N) * WGT_CHANNELS;
+}
+
+// Shard row stride in weights (whole 512-bit words)
+inline int wgt_shard_stride(int N) {
+    #pragma HLS INLINE
+    return round_up(wgt_shard_tiles(N), TILES_PER_WORD) * PE_COLS;
+}
+
+// ---- Shard addressing (host sharding and LoadWgt) ----
+// Words per tile-major local tile
+inline int wgt_tile_words(int K) {
+    #pragma HLS INLINE
+    return num_tiles(K, COLS_PER_WORD);
+}
+
+inline int scale_tile_words(int K) {
+    #pragma HLS INLINE
+    return num_tiles(num_tiles(K, K_GROUP) * COL_SCALES, AXI_BYTES);
+}
+
+// ---- Block-sparse weights (make WGT_SPARSE=1) ----
+// Pruned layers have whole blocks of zero weights. A block is SPARSE_BLOCK
+// consecutive K-columns of one N-tile: a tile-major word, or one exponent
+// group when groups run along K. With SA_WGT_SPARSE every weight shard is
+// followed by a block index per local tile, sparse_index_words(K) words of
+// uint16 entries:
+//   entry 0            number of nonzero blocks
+//   entries 1..count   their block numbers, ascending
+// The array path then loads and multiplies only those blocks, so an N-tile
+// costs count * SPARSE_BLOCK cycles instead of K. The GEMV and K-split
+// paths still walk the dense shard. Broadcast engine only: the mesh skews
+// its operands by K index.
+#ifndef SA_WGT_SPARSE
+#define SA_WGT_SPARSE 0
+#endif
+const int SPARSE_BLOCK = (K_GROUP > COLS_PER_WORD) ? K_GROUP : COLS_PER_WORD;
+const int SPARSE_MAX_BLOCKS = K_DIM / SPARSE_BLOCK;
+const int INDEX_PER_WORD = AXI_BYTES / 2;
+typedef uint16_t blk_idx_t;
+static_assert(!SA_WGT_SPARSE || (SA_WGT_TILE_MAJOR && !SA_SYSTOLIC_MESH),
+              "block-sparse weights need tile-major shards and the broadcast engine");
+static_assert(K_DIM % SPARSE_BLOCK == 0 && SPARSE_BLOCK % K_GROUP == 0,
+              "blocks hold whole exponent groups");
+
+inline int sparse_blocks(int K) {
+    #pragma HLS INLINE
+    return num_tiles(K, SPARSE_BLOCK);
+}
+
+inline int sparse_index_words(int K) {
+    #pragma HLS INLINE
+    return num_tiles(1 + sparse_blocks(K), INDEX_PER_WORD);
+}
+
+// Bytes per channel
+inline int wgt_shard_bytes(int K, int N) {
+    #pragma HLS INLINE
+#if SA_WGT_TILE_MAJOR
+    return wgt_shard_tiles(N) * (wgt_tile_words(K) + (SA_WGT_SPARSE ? sparse_index_words(K) : 0)) * AXI_BYTES;
+#else
+    return K * wgt_shard_stride(N) / 2;
+#endif
+}
+
+inline int scale_shard_bytes(int K, int N) {
+    #pragma HLS INLINE
+#if SA_WGT_TILE_MAJOR
+    return wgt_shard_tiles(N) * scale_tile_words(K) * AXI_BYTES;
+#else
+    return round_up(num_scales(K, wgt_shard_stride(N)), AXI_BYTES);
+#endif
+}
+
+// Byte / scale index of K-column k of local tile local_tile in a shard
+inline int wgt_col_offset(int K, int N, int k, int local_tile) {
+    #pragma HLS INLINE
+#if SA_WGT_TILE_MAJOR
+    (void)N;
+    return local_tile * wgt_tile_words(K) * AXI_BYTES + k * COL_BYTES;
+#else
+    (void)K;
+    return (k * wgt_shard_stride(N) + local_tile * PE_COLS) / 2;
+#endif
+}
+
+inline int scale_col_offset(int K, int N, int k, int local_tile) {
+    #pragma HLS INLINE
+#if SA_WGT_TILE_MAJOR
+    (void)N;
+    return local_tile * scale_tile_words(K) * AXI_BYTES + (k / K_GROUP) * COL_SCALES;
+#else
+    (void)K;
+    return scale_index(k, local_tile * PE_COLS, wgt_shard_stride(N));
+#endif
+}
+
+// Word of the shard holding entry 0 of local_tile's block index
+inline int sparse_index_word(int K, int N, int local_tile) {
+    #pragma HLS INLINE
+    return wgt_shard_tiles(N) * wgt_tile_words(K) + local_tile * sparse_index_words(K);
+}
 
-// 4MB cache split intelligently
-// Activation cache: 1MB → 16 M-tiles (128×512 = 128KB, can fit all!)
-// Weight cache: 3MB → 24 N-tiles (24×16×512 = 192KB)
-const int ACT_CACHE_SIZE = 8;   // Cache ALL 8 M-tiles (only 64KB!)
-const int WGT_CACHE_SIZE = 24;  // Cache 24 out of 32 N-tiles
+// M is processed in blocks of ACT_CACHE_SIZE tiles. If every N-tile fits in
+// W_cache (whole K) the weights stay resident after the first block;
+// otherwise they are streamed again for each block.
+inline int num_wgt_passes(int M, int K, int N) {
+    #pragma HLS INLINE
+    int num_m_blocks = num_tiles(num_tiles(M, PE_ROWS), ACT_CACHE_SIZE);
+    return (num_n_tiles(N) <= WGT_CACHE_SIZE && K <= K_DIM) ? 1 : num_m_blocks;
+}
+
+// M=1 runs on the GEMV path when the accumulators fit; anything else falls
+// back to the array. GEMV keeps its K activations banked COLS_PER_WORD
+// deep, so any K up to K_MAX.
+inline bool is_gemv(int M, int N) {
+    #pragma HLS INLINE
+#if SA_WGT_TILE_MAJOR
+    (void)N;  // accumulators are per tile, so N is unbounded
+    return M == 1;
+#else
+    return M == 1 && N <= GEMV_MAX_N &&
+           wgt_shard_stride(N) / GEMV_LANES >= GEMV_MIN_WORDS;
+#endif
+}
+
+// ---- Kernel commands (weight-stationary mode) ----
+// CMD_LOAD_WGT parks every N-tile of a K x N layer in W_cache; W_cache keeps
+// its contents between invocations, so any number of CMD_COMPUTE calls with
+// the same K and N then move only activations and results. Stationary calls
+// always use the array (no GEMV path) and need wgt_stationary_fits(K, N).
+const int CMD_RUN = 0;       // stream weights and activations (default)
+const int CMD_LOAD_WGT = 1;  // weights only, no activations or result
+const int CMD_COMPUTE = 2;   // activations against the parked weights
+
+inline bool wgt_stationary_fits(int K, int N) {
+    #pragma HLS INLINE
+    return num_n_tiles(N) <= WGT_CACHE_SIZE && K <= K_DIM;
+}
+
+inline bool use_gemv(int cmd, int M, int N) {
+    #pragma HLS INLINE
+    return cmd == CMD_RUN && is_gemv(M, N);
+}
+
+// ---- K-split (make K_SPLIT=<n>) ----
+// A call with a single M-tile has one tile per N-tile to work on, so the
+// array spends K serial cycles per N-tile. With SA_K_SPLIT = S > 1 such calls
+// run on S extra array instances (ComputeSlice) instead: the weight words of
+// every N-tile are dealt round robin to the slices (word w to slice w % S,
+// padded to whole rounds with zero words), each slice MACs its K-columns
+// into a partial tile, and ReduceK sums the S partials and rounds them. An
+// N-tile then takes about K / S cycles. Tile-major shards only.
+#ifndef SA_K_SPLIT
+#define SA_K_SPLIT 1
+#endif
+const int K_SPLIT = SA_K_SPLIT;
+const int K_SLICE_DIM = K_DIM / K_SPLIT;  // K-columns held by one slice
+static_assert(K_SPLIT == 1 || (SA_WGT_TILE_MAJOR && (K_DIM / COLS_PER_WORD) % K_SPLIT == 0),
+              "K-split deals whole tile-major words to the slices");
+
+typedef tapa::vec_t<acc_t, PE_COLS> part_vec_t;  // one row of a partial C tile
+
+inline bool use_ksplit(int cmd, int M, int K, int N) {
+    #pragma HLS INLINE
+    return K_SPLIT > 1 && cmd == CMD_RUN && !is_gemv(M, N) && num_tiles(M, PE_ROWS) == 1 && K <= K_DIM;
+}
+
+// Weight words per tile a slice receives, and its K-columns
+inline int slice_cols(int K) {
+    #pragma HLS INLINE
+    return num_tiles(wgt_tile_words(K), K_SPLIT) * COLS_PER_WORD;
+}
+
+// ---- K-streaming (K > K_DIM) ----
+// Array calls whose K exceeds the caches run output-stationary: the
+// partial sums of up to ACC_TILES N-tiles of every M-tile of the block stay
+// in C_acc while K passes through in chunks of K_DIM columns. For each
+// M-block and group of ACC_TILES N-tiles, chunk c brings K-columns
+// [c * K_DIM, (c + 1) * K_DIM) of the block's activations and of every
+// tile of the group through A_cache and the W_cache ring; each tile
+// starts from its accumulators of chunk c - 1 and the last chunk writes
+// the finished rows. Weights are read once per M-block, activations once
+// per N-group. On-chip memory is bounded by K_DIM, not K.
+#ifndef SA_ACC_TILES
+#define SA_ACC_TILES SA_WGT_CACHE_SIZE
+#endif
+const int ACC_TILES = SA_ACC_TILES;  // N-tiles per M-tile in C_acc
+static_assert(ACC_TILES % WGT_CHANNELS == 0, "N-groups are whole rounds of weight channels");
+static_assert(!SA_WGT_SPARSE || K_MAX == K_DIM, "block-sparse shards are indexed over the whole K");
+
+inline bool use_kstream(int cmd, int M, int K, int N) {
+    #pragma HLS INLINE
+    return cmd == CMD_RUN && K > K_DIM && !is_gemv(M, N);
+}
+
+inline int num_k_chunks(int K) {
+    #pragma HLS INLINE
+    return num_tiles(K, K_DIM);
+}
+
+// K-columns of chunk c
+inline int chunk_cols(int K, int c) {
+    #pragma HLS INLINE
+    return (K - c * K_DIM < K_DIM) ? K - c * K_DIM : K_DIM;
+}
+
+// N-tiles per N-group (all of them unless K-streaming)
+inline int n_group_tiles(int cmd, int M, int K, int N) {
+    #pragma HLS INLINE
+    return (use_kstream(cmd, M, K, N) && num_n_tiles(N) > ACC_TILES) ? ACC_TILES : num_n_tiles(N);
+}
+
+// ---- Fused epilogue ----
+// With epi != EPI_OFF every finished int32 result is turned into int8 on
+// chip before it is stored, into result_q8 (M x out_row_stride(N) int8)
+// instead of result:
+//   q = clamp(round((acc + bias[n]) * mult[n] / 2^shift[n]), -128, 127)
+// followed by ReLU or a 256-entry int8 lookup table (e.g. GELU). The
+// parameters come from the epilogue port, in words of PE_COLS int32:
+//   EPI_LUT_WORDS words   the table, entry x + 128 in byte x + 128
+//   per real N-tile t     bias word, then requant word (mult | shift << 16)
+const int EPI_OFF = 0;      // int32 results (default)
+const int EPI_REQUANT = 1;  // bias + requantize to int8
+const int EPI_RELU = 2;     // ... then ReLU
+const int EPI_LUT = 3;      // ... then the lookup table
+const int EPI_LUT_WORDS = 256 / 4 / PE_COLS;
+const int EPI_MAX_N = 16384;  // per-column parameters kept on chip
+const int EPI_MAX_SHIFT = 47;
+static_assert(256 % (4 * PE_COLS) == 0, "the epilogue table fills whole words");
+
+typedef tapa::vec_t<int8_t, PE_COLS> q8_vec_t;  // one row of a requantized C tile
+
+inline int epi_words(int N) {
+    #pragma HLS INLINE
+    return EPI_LUT_WORDS + 2 * num_tiles(N, PE_COLS);
+}
 
-inline int8_t unpack_dequantize_weight(
-    uint8_t packed_byte,
-    bool is_upper,
-    uint8_t scale_factor
+// One output of the epilogue (shared by the kernel and the host reference)
+inline int8_t epilogue_apply(int32_t acc, int32_t bias, int32_t rq, int epi, const int8_t lut[256]) {
+    #pragma HLS INLINE
+    const int64_t x = ((int64_t)acc + bias) * (int16_t)(rq & 0xFFFF);
+    const int shift = (rq >> 16) & 0x3F;
+    const int64_t r = (x + (((int64_t)1 << shift) >> 1)) >> shift;
+    int q = (r < -128) ? -128 : (r > 127) ? 127 : (int)r;
+    if (epi == EPI_RELU && q < 0) q = 0;
+    if (epi == EPI_LUT) q = lut[q + 128];
+    return (int8_t)q;
+}
+
+// C tile rows a call produces (GEMV: one row per real N-tile)
+inline int num_out_rows(int M, int N, int cmd) {
+    #pragma HLS INLINE
+    if (cmd == CMD_LOAD_WGT) return 0;
+    if (use_gemv(cmd, M, N)) return num_tiles(N, PE_COLS);
+    return num_n_tiles(N) * num_tiles(M, PE_ROWS) * PE_ROWS;
+}
+
+// ---- Layer chaining ----
+// A call with CHAIN_OUT (and an epilogue) keeps its int8 result on chip
+// instead of storing it, and the next call with CHAIN_IN takes that result
+// as its activations instead of reading `activations`: its M must be the
+// same and its K the previous N. Only the last layer of a chain stores its
+// result. The chained result is one M-block (M <= ACT_CACHE_SIZE * PE_ROWS)
+// of at most K_DIM columns; calls that do not fit read and store in HBM.
+const int CHAIN_IN = 1;   // activations from the previous call's result
+const int CHAIN_OUT = 2;  // keep the int8 result for the next call
+
+inline bool chain_fits(int M, int N) {
+    #pragma HLS INLINE
+    return num_tiles(M, PE_ROWS) <= ACT_CACHE_SIZE && N <= K_DIM;
+}
+
+inline bool use_chain_in(int cmd, int M, int chain) {
+    #pragma HLS INLINE
+    return (chain & CHAIN_IN) && cmd != CMD_LOAD_WGT && chain_fits(M, 1);
+}
+
+inline bool use_chain_out(int cmd, int M, int N, int epi, int chain) {
+    #pragma HLS INLINE
+    return (chain & CHAIN_OUT) && epi != EPI_OFF && cmd != CMD_LOAD_WGT && chain_fits(M, N);
+}
+
+// One systolic PE: MAC on the operands arriving from the west/north, then
+// register them for the east/south neighbours.
+inline void systolic_pe(
+    int8_t a_west,
+    wgt_t w_north,
+    int8_t& a_east,
+    wgt_t& w_south,
+    acc_t& acc
+) {
+    #pragma HLS INLINE
+    acc += (acc_t)a_west * (acc_t)w_north;
+    a_east = a_west;
+    w_south = w_north;
+}
+
+// ---- DSP packing ----
+// a * (w1 * 2^18 + w0) = a*w1 * 2^18 + a*w0 is one 27 x 8 bit multiply, a
+// single DSP48E2; the widths are spelled out so HLS binds exactly that.
+// a and w0 are int8, so |a*w0| <= 128*128 = 2^14 < 2^17 and the low 18 bits
+// are a*w0 in two's complement; the high product is corrected for the
+// borrow a negative low product takes from it.
+const int DSP_PACK_SHIFT = 18;
+typedef ap_int<27> dsp_pack_t;  // w1 * 2^18 + w0, the 27-bit multiplier input
+typedef ap_int<35> dsp_prod_t;  // 27 x 8 bit product
+
+// a * w0 and a * w1, from one multiplier when built with SA_DSP_PACK
+inline void pe_mul2(int8_t a, wgt_t w0, wgt_t w1, int32_t& p0, int32_t& p1) {
+    #pragma HLS INLINE
+#if SA_DSP_PACK
+    const dsp_pack_t w = (dsp_pack_t(w1) << DSP_PACK_SHIFT) + dsp_pack_t(w0);
+    const dsp_prod_t p = ap_int<8>(a) * w;
+    #pragma HLS BIND_OP variable=p op=mul impl=dsp
+    const ap_int<DSP_PACK_SHIFT> lo = p;  // low bits, sign-extended
+    p0 = (int32_t)lo;
+    p1 = (int32_t)((p - lo) >> DSP_PACK_SHIFT);
+#else
+    p0 = (int32_t)a * w0;
+    p1 = (int32_t)a * w1;
+#endif
+}
+
+// Columns sharing one multiplier, and the mesh width in PEs
+#if SA_DSP_PACK
+const int PE_PACK = 2;
+#else
+const int PE_PACK = 1;
+#endif
+const int MESH_COLS = PE_COLS / PE_PACK;
+
+// Mesh PE of a packed array: two neighbouring columns share the activation
+// and the multiplier, so a PE row spans PE_COLS / 2 such PEs
+inline void systolic_pe2(
+    int8_t a_west,
+    wgt_t w0_north,
+    wgt_t w1_north,
+    int8_t& a_east,
+    wgt_t& w0_south,
+    wgt_t& w1_south,
+    acc_t& acc0,
+    acc_t& acc1
 ) {
     #pragma HLS INLINE
-    int8_t w_4bit = is_upper ? ((packed_byte >> 4) & 0x0F) : (packed_byte & 0x0F);
-    if (w_4bit & 0x08) w_4bit |= 0xF0;
-    uint8_t shift_amount = (scale_factor & 0x3) * 2;
-    return w_4bit << shift_amount;
+    int32_t p0, p1;
+    pe_mul2(a_west, w0_north, w1_north, p0, p1);
+    acc0 += p0;
+    acc1 += p1;
+    a_east = a_west;
+    w0_south = w0_north;
+    w1_south = w1_north;
+}
+
+template <int LANES, int SCALES>
+inline void dequant_pkt(
+    const mxint4_pkt_t<LANES, SCALES>& raw,
+    tapa::vec_t<wgt_t, LANES>& w
+) {
+    #pragma HLS INLINE
+    for (int l = 0; l < LANES; ++l) {
+        #pragma HLS UNROLL
+        w[l] = wgt_fmt::dequant(
+            raw.packed_bytes[l / 2], l & 1, raw.scale_factors[wgt_fmt::lane_scale(l)]
+        );
+    }
+}
+
+// Read one token from channel ch of a stream array (ch is a runtime value)
+template <typename T, uint64_t N>
+inline T read_channel(tapa::istreams<T, N>& q, int ch) {
+    #pragma HLS INLINE
+    T val = T();  // ch is always in range; only the compiler can't tell
+    for (int c = 0; c < (int)N; ++c) {
+        #pragma HLS UNROLL
+        if (c == ch) val = q[c].read();
+    }
+    return val;
+}
+
+template <typename T, uint64_t N>
+inline bool try_read_channel(tapa::istreams<T, N>& q, int ch, T& val) {
+    #pragma HLS INLINE
+    bool ok = false;
+    for (int c = 0; c < (int)N; ++c) {
+        #pragma HLS UNROLL
+        if (c == ch) ok = q[c].try_read(val);
+    }
+    return ok;
+}
+
+// Write one token to channel ch of a stream array
+template <typename T, uint64_t N>
+inline void write_channel(tapa::ostreams<T, N>& q, int ch, const T& val) {
+    #pragma HLS INLINE
+    for (int c = 0; c < (int)N; ++c) {
+        #pragma HLS UNROLL
+        if (c == ch) q[c].write(val);
+    }
+}
+
+// ---- Profiling (make PROFILE=1) ----
+// Every task reports the end of each of its phases to a Profiler task as a
+// (phase, loop iterations) event. The Profiler runs a free-running cycle
+// counter, charges the cycles since the task's previous event to the
+// phase, and at the end writes the totals to the stats port (PROF_WORDS
+// uint64, see prof_index()). Cycles beyond a phase's iterations are cycles
+// its II=1 loops spent blocked on a stream or memory port. Without
+// SA_PROFILE the events and the Profiler compile to nothing.
+#ifndef SA_PROFILE
+#define SA_PROFILE 0
+#endif
+const bool PROFILE = SA_PROFILE;
+
+typedef uint64_t prof_event_t;  // phase << 32 | iterations
+
+// Profiled tasks: one slot each, LoadWgt one per channel (the K-split
+// slices and ReduceK are not profiled)
+const int PROF_LOAD_ACT = 0;
+const int PROF_COMPUTE = 1;
+const int PROF_EPILOGUE = 2;
+const int PROF_STORE = 3;
+const int PROF_STORE_Q8 = 4;
+const int PROF_LOAD_WGT = 5;  // + channel
+const int PROF_TASKS = PROF_LOAD_WGT + WGT_CHANNELS;
+const int PROF_PHASES = 4;
+
+// Phases of each task
+const int PH_HBM_ACT = 0, PH_CHAIN_ACT = 1, PH_CHAIN_ROWS = 2;     // LoadAct
+const int PH_LOAD_WGT = 0;                                           // LoadWgt
+const int PH_RECV_ACT = 0, PH_RECV_WGT = 1, PH_MAC = 2, PH_WRITE = 3; // Compute
+const int PH_LOAD_PARAMS = 0, PH_APPLY = 1;                          // Epilogue
+const int PH_STORE = 0;                                              // StoreResult/Q8
+const int PH_DONE = 0xFF;  // last event of a task
+
+// stats[0] = cycles of the call, stats[1] = PROF_TASKS, then per task and
+// phase: cycles at prof_index(), iterations at prof_index() + 1
+const int PROF_WORDS = 2 + 2 * PROF_TASKS * PROF_PHASES;
+
+inline int prof_index(int task, int phase) {
+    #pragma HLS INLINE
+    return 2 + 2 * (task * PROF_PHASES + phase);
+}
+
+inline void prof_mark(tapa::ostream<prof_event_t>& prof_q, int phase, int iters) {
+    #pragma HLS INLINE
+    if (PROFILE) prof_q.write(((prof_event_t)phase << 32) | (uint32_t)iters);
 }
 
 void SystolicArrayKernel(
-    tapa::mmap<int8_t> activations,
-    tapa::mmap<uint8_t> weights_packed,
-    tapa::mmap<uint8_t> scales,
-    tapa::mmap<int32_t> result,
-    int M, int K, int N
+    tapa::mmap<act_word_t> activations,
+    tapa::mmaps<byte_word_t, WGT_CHANNELS> weights_packed,
+    tapa::mmaps<byte_word_t, WGT_CHANNELS> scales,
+    tapa::mmap<out_vec_t> epilogue,
+    tapa::mmap<out_vec_t> result,
+    tapa::mmap<q8_vec_t> result_q8,
+    int M, int K, int N,
+    int cmd,
+    int epi,
+    int chain,
+    tapa::mmap<uint64_t> stats
 );
 
 #endif
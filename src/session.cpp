@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "session.h"
+
+SystolicSession::SystolicSession(
+    const std::string& bitstream,
+    Backend backend,
+    std::chrono::microseconds batch_window,
+    int streams
+) : bitstream_(bitstream), backend_(backend), batch_window_(batch_window),
+    streams_((backend == Backend::FPGA && bitstream.empty()) ? 1 : std::max(1, streams)) {
+    dispatcher_ = std::thread(&SystolicSession::dispatch_loop, this);
+}
+
+SystolicSession::~SystolicSession() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    dispatcher_.join();
+}
+
+int SystolicSession::add_layer(
+    const aligned_vector<uint8_t>& wgt_packed,
+    const aligned_vector<uint8_t>& scales,
+    int K, int N
+) {
+    if (K < 1 || K > K_MAX || N < 1) {
+        throw std::invalid_argument("SystolicSession: layer needs 1 <= K <= K_MAX and N >= 1");
+    }
+    auto layer = std::make_unique<Layer>();
+    layer->K = K;
+    layer->N = N;
+    if (backend_ == Backend::CPU) {
+        prepare_cpu_weights(wgt_packed, scales, layer->cpu_wgt, K, N);
+    } else {
+        shard_weights(wgt_packed, scales, layer->wgt_shards, layer->scale_shards, K, N);
+        layer->view = view_shards(layer->wgt_shards, layer->scale_shards);
+    }
+    return register_layer(std::move(layer));
+}
+
+int SystolicSession::add_layer(const WeightView& wgt, int K, int N) {
+    if (K < 1 || K > K_MAX || N < 1) {
+        throw std::invalid_argument("SystolicSession: layer needs 1 <= K <= K_MAX and N >= 1");
+    }
+    auto layer = std::make_unique<Layer>();
+    layer->K = K;
+    layer->N = N;
+    if (backend_ == Backend::CPU) {
+        aligned_vector<uint8_t> wgt_packed, scales;
+        unshard_weights(wgt, wgt_packed, scales, K, N);
+        prepare_cpu_weights(wgt_packed, scales, layer->cpu_wgt, K, N);
+    } else {
+        layer->view = wgt;
+    }
+    return register_layer(std::move(layer));
+}
+
+int SystolicSession::register_layer(std::unique_ptr<Layer> layer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    layers_.push_back(std::move(layer));
+    return (int)layers_.size() - 1;
+}
+
+std::future<std::vector<int32_t>> SystolicSession::submit(
+    std::vector<int8_t> act, int M, int layer_id
+) {
+    Request req;
+    req.act = std::move(act);
+    req.M = M;
+    req.layer_id = layer_id;
+    req.arrival = std::chrono::steady_clock::now();
+    auto result = req.result.get_future();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (layer_id < 0 || layer_id >= (int)layers_.size()) {
+            throw std::invalid_argument("SystolicSession: unknown layer id");
+        }
+        if (M < 1 || (int64_t)req.act.size() != (int64_t)M * layers_[layer_id]->K) {
+            throw std::invalid_argument("SystolicSession: activations must be M x K");
+        }
+        queue_.push_back(std::move(req));
+    }
+    cv_.notify_all();
+    return result;
+}
+
+SystolicSession::Stats SystolicSession::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats st = stats_;
+    st.buffer_bytes = pool_.bytes();
+    return st;
+}
+
+// ============================================================================
+// Batching: take the oldest request plus every queued request for the same
+// layer that still fits in M_DIM rows, waiting up to batch_window_ (from the
+// oldest arrival) for a partial batch to fill. A request larger than M_DIM
+// runs as a batch of its own. Returns false when there is nothing to run and
+// either a kernel call beyond the `retired` ones returned or the session is
+// stopping.
+// ============================================================================
+bool SystolicSession::take_batch(Batch& batch, int64_t retired) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&] { return !queue_.empty() || stop_ || runs_done_ > retired; });
+    if (queue_.empty()) return false;
+
+    batch.layer_id = queue_.front().layer_id;
+    batch.layer = layers_[batch.layer_id].get();
+    batch.M = 0;
+    batch.requests.clear();
+
+    const auto deadline = queue_.front().arrival + batch_window_;
+    for (;;) {
+        for (auto it = queue_.begin(); it != queue_.end();) {
+            if (it->layer_id == batch.layer_id && (batch.M == 0 || batch.M + it->M <= M_DIM)) {
+                batch.M += it->M;
+                batch.requests.push_back(std::move(*it));
+                it = queue_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (batch.M >= M_DIM || stop_ || std::chrono::steady_clock::now() >= deadline) break;
+        cv_.wait_until(lock, deadline);
+    }
+    return true;
+}
+
+// Stack the requests' rows into the batch buffers (kernel layout). Only the
+// first K columns of a row are written, so the pad columns stay zero.
+void SystolicSession::pack_batch(Batch& batch) {
+    const int K = batch.layer->K;
+    const int K_STRIDE = act_row_stride(K);
+
+    batch.buf = pool_.acquire(batch.M, K, batch.layer->N);
+
+    int row = 0;
+    for (const Request& req : batch.requests) {
+        for (int m = 0; m < req.M; m++) {
+            std::copy_n(&req.act[m * K], K, &batch.buf->act[(row + m) * K_STRIDE]);
+        }
+        row += req.M;
+    }
+}
+
+// Device side of one batch (runs on its own thread, up to streams_ at once)
+int64_t SystolicSession::run_batch(Batch& batch) {
+    Layer& layer = *batch.layer;
+    if (backend_ == Backend::CPU) {
+        auto t0 = std::chrono::steady_clock::now();
+        cpu_gemm(batch.buf->act, layer.cpu_wgt, batch.buf->out.data(), out_row_stride(layer.N), batch.M);
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+    }
+
+    auto run = [&](int cmd) {
+        return invoke_kernel(
+            bitstream_, batch.buf->act, layer.view, batch.buf->out,
+            batch.M, layer.K, layer.N, cmd
+        );
+    };
+
+    // Concurrent streams never park a layer, so resident_layer_ stays -1
+    if (streams_ > 1) return run(CMD_RUN);
+    if (!wgt_stationary_fits(layer.K, layer.N)) {
+        resident_layer_ = -1;  // the streamed tiles overwrite W_cache
+        return run(CMD_RUN);
+    }
+
+    int64_t ns = 0;
+    if (resident_layer_ != batch.layer_id) {
+        resident_layer_ = -1;
+        ns += run(CMD_LOAD_WGT);
+        resident_layer_ = batch.layer_id;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.weight_loads++;
+    }
+    return ns + run(CMD_COMPUTE);
+}
+
+// Hand every request its rows of the batch result
+void SystolicSession::finish_batch(Batch& batch, std::future<int64_t>& done) {
+    const int N = batch.layer->N;
+    const int OUT_STRIDE = out_row_stride(N);
+
+    try {
+        int64_t ns = done.get();
+        int row = 0;
+        for (Request& req : batch.requests) {
+            std::vector<int32_t> out(req.M * N);
+            for (int m = 0; m < req.M; m++) {
+                std::copy_n(&batch.buf->out[(row + m) * OUT_STRIDE], N, &out[m * N]);
+            }
+            row += req.M;
+            req.result.set_value(std::move(out));
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.requests += batch.requests.size();
+        stats_.batches++;
+        stats_.rows += batch.M;
+        stats_.device_ns += ns;
+    } catch (...) {
+        for (Request& req : batch.requests) {
+            req.result.set_exception(std::current_exception());
+        }
+    }
+    batch.requests.clear();
+    pool_.release(batch.buf);
+    batch.buf = nullptr;
+}
+
+// ============================================================================
+// Dispatcher: a ring of streams_ + 1 batch slots. Batch i+1 is formed and
+// packed while up to streams_ earlier batches run, each on its own thread;
+// they are retired oldest first, so a slot comes round again only after its
+// batch finished.
+// ============================================================================
+void SystolicSession::dispatch_loop() {
+    std::vector<Batch> slots(streams_ + 1);
+    std::deque<std::pair<Batch*, std::future<int64_t>>> running;  // oldest first
+    int64_t retired = 0;
+    size_t cur = 0;
+
+    auto retire_oldest = [&] {
+        finish_batch(*running.front().first, running.front().second);
+        running.pop_front();
+        retired++;
+    };
+
+    for (;;) {
+        Batch& batch = slots[cur];
+        const bool have = take_batch(batch, retired);
+        if (have) pack_batch(batch);
+
+        // Hand back whatever has returned; wait for the oldest call when
+        // every stream is busy, or when there is nothing else to do
+        const int64_t before = retired;
+        while (!running.empty() &&
+               running.front().second.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            retire_oldest();
+        }
+        if (!running.empty() && (have ? (int)running.size() >= streams_ : retired == before)) {
+            retire_oldest();
+        }
+        if (!have) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stop_ && queue_.empty() && running.empty()) break;
+            continue;
+        }
+
+        running.emplace_back(&batch, std::async(std::launch::async, [this, &batch] {
+            auto notify = [this] {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    runs_done_++;
+                }
+                cv_.notify_all();
+            };
+            try {
+                int64_t ns = run_batch(batch);
+                notify();
+                return ns;
+            } catch (...) {
+                notify();
+                throw;
+            }
+        }));
+        cur = (cur + 1) % slots.size();
+    }
+}
@@ -0,0 +1,128 @@
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "host.h"
+
+// ============================================================================
+// SystolicSession: host runtime in front of SystolicArrayKernel
+//
+// Requests for the same layer are coalesced into batches of up to M_DIM rows
+// (one M-block of the array). A dispatcher thread packs batch i+1 into its
+// own set of host buffers while up to `streams` earlier batches are in
+// flight, each kernel call (host-to-device copy, run, copy back) on its own
+// thread, and completes each request's future when its batch returns, in
+// batch order. The buffers come from a BufferPool, so each layer shape
+// allocates and pins its sets once and every later batch only copies its
+// rows in and out. With a single stream, layers that fit in W_cache are
+// loaded once (CMD_LOAD_WGT) and then run weight-stationary until another
+// layer displaces them; concurrent streams share no kernel state, so every
+// batch streams its weights (CMD_RUN). Software simulation runs one stream
+// (the simulated kernel is not reentrant). With Backend::CPU the same
+// batches run through cpu_gemm instead.
+// ============================================================================
+class SystolicSession {
+ public:
+    struct Stats {
+        int64_t requests = 0;
+        int64_t batches = 0;
+        int64_t rows = 0;          // activation rows sent to the device
+        int64_t weight_loads = 0;  // CMD_LOAD_WGT calls
+        int64_t device_ns = 0;     // total kernel time (summed over streams)
+        size_t buffer_bytes = 0;   // held by the buffer pool
+    };
+
+    // batch_window: how long a partial batch waits for more requests;
+    // streams: kernel calls in flight at once
+    explicit SystolicSession(
+        const std::string& bitstream,
+        Backend backend = Backend::FPGA,
+        std::chrono::microseconds batch_window = std::chrono::microseconds(200),
+        int streams = 1
+    );
+    ~SystolicSession();  // finishes every queued request
+
+    SystolicSession(const SystolicSession&) = delete;
+    SystolicSession& operator=(const SystolicSession&) = delete;
+
+    // Register a K x N layer given in the padded MXINT4 layout of
+    // pack_weights(); returns its layer id
+    int add_layer(
+        const aligned_vector<uint8_t>& wgt_packed,
+        const aligned_vector<uint8_t>& scales,
+        int K, int N
+    );
+
+    // Register a layer that is already sharded, e.g. a MappedWeights view.
+    // Zero-copy on the FPGA backend: the memory must outlive the session.
+    int add_layer(const WeightView& wgt, int K, int N);
+
+    // Queue M x K int8 activations (row-major, unpadded) for a layer. The
+    // future yields the M x N int32 result.
+    std::future<std::vector<int32_t>> submit(std::vector<int8_t> act, int M, int layer_id);
+
+    Stats stats() const;
+    int streams() const { return streams_; }
+
+ private:
+    struct Layer {
+        int K, N;
+        shard_array_t wgt_shards;    // FPGA backend
+        shard_array_t scale_shards;
+        WeightView view;             // what the kernel reads (wgt/scale_shards or external)
+        CpuWeights cpu_wgt;          // CPU backend
+    };
+
+    struct Request {
+        std::vector<int8_t> act;
+        int M;
+        int layer_id;
+        std::chrono::steady_clock::time_point arrival;
+        std::promise<std::vector<int32_t>> result;
+    };
+
+    // One batch and the pooled host buffers it is packed into
+    struct Batch {
+        int layer_id = -1;
+        Layer* layer = nullptr;
+        int M = 0;
+        std::vector<Request> requests;
+        KernelBuffers* buf = nullptr;
+    };
+
+    int register_layer(std::unique_ptr<Layer> layer);
+    bool take_batch(Batch& batch, int64_t retired);
+    void pack_batch(Batch& batch);
+    int64_t run_batch(Batch& batch);
+    void finish_batch(Batch& batch, std::future<int64_t>& done);
+    void dispatch_loop();
+
+    const std::string bitstream_;
+    const Backend backend_;
+    const std::chrono::microseconds batch_window_;
+    const int streams_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<std::unique_ptr<Layer>> layers_;
+    std::deque<Request> queue_;
+    int64_t runs_done_ = 0;    // kernel calls returned, retired or not
+    bool stop_ = false;
+    Stats stats_;
+    BufferPool pool_;
+
+    int resident_layer_ = -1;  // layer parked in W_cache (one stream only: its in-flight call owns it)
+    std::thread dispatcher_;
+};
+
+#endif
@@ -0,0 +1,120 @@
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "weight_file.h"
+
+static const char WEIGHT_FILE_MAGIC[8] = {'S', 'A', 'M', 'X', 'I', 'N', 'T', '4'};
+
+static uint64_t align_up(uint64_t bytes) {
+    return (bytes + WEIGHT_FILE_ALIGN - 1) / WEIGHT_FILE_ALIGN * WEIGHT_FILE_ALIGN;
+}
+
+// Offsets of channel c's sections
+static uint64_t packed_offset(const WeightFileHeader& h, int c) {
+    return h.data_offset + c * (align_up(h.packed_bytes) + align_up(h.scale_bytes));
+}
+
+static uint64_t scale_offset(const WeightFileHeader& h, int c) {
+    return packed_offset(h, c) + align_up(h.packed_bytes);
+}
+
+void save_weights(const std::string& path, const WeightView& wgt, int K, int N) {
+    WeightFileHeader h = {};
+    std::memcpy(h.magic, WEIGHT_FILE_MAGIC, sizeof(h.magic));
+    h.version = WEIGHT_FILE_VERSION;
+    h.header_bytes = sizeof(WeightFileHeader);
+    h.K = K;
+    h.N = N;
+    h.group_size = GROUP_SIZE;
+    h.pe_cols = PE_COLS;
+    h.wgt_channels = WGT_CHANNELS;
+    h.tile_major = SA_WGT_TILE_MAJOR;
+    h.sparse = SA_WGT_SPARSE;
+    h.group_axis = SA_GROUP_AXIS;
+    h.exp_bits = wgt_fmt::exp_bits;
+    h.frac_bits = wgt_fmt::frac_bits;
+    h.max_exp = wgt_fmt::max_exp;
+    h.packed_bytes = wgt.packed_bytes;
+    h.scale_bytes = wgt.scale_bytes;
+    h.data_offset = align_up(sizeof(WeightFileHeader));
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) throw std::runtime_error("save_weights: cannot open " + path);
+
+    const std::vector<char> zeros(WEIGHT_FILE_ALIGN, 0);
+    auto write_section = [&](const void* data, uint64_t bytes) {
+        out.write(static_cast<const char*>(data), bytes);
+        out.write(zeros.data(), align_up(bytes) - bytes);
+    };
+    write_section(&h, sizeof(h));
+    for (int c = 0; c < WGT_CHANNELS; c++) {
+        write_section(wgt.packed[c], wgt.packed_bytes);
+        write_section(wgt.scales[c], wgt.scale_bytes);
+    }
+    if (!out) throw std::runtime_error("save_weights: write failed for " + path);
+}
+
+MappedWeights::MappedWeights(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("MappedWeights: cannot open " + path);
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(WeightFileHeader)) {
+        ::close(fd);
+        throw std::runtime_error("MappedWeights: " + path + " is not a weight file");
+    }
+    size_ = st.st_size;
+    base_ = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base_ == MAP_FAILED) {
+        base_ = nullptr;
+        throw std::runtime_error("MappedWeights: mmap failed for " + path);
+    }
+
+    std::memcpy(&header_, base_, sizeof(header_));
+    const WeightFileHeader& h = header_;
+    const char* error = nullptr;
+    if (std::memcmp(h.magic, WEIGHT_FILE_MAGIC, sizeof(h.magic)) != 0) {
+        error = "bad magic";
+    } else if (h.version != WEIGHT_FILE_VERSION || h.header_bytes != sizeof(WeightFileHeader)) {
+        error = "unsupported version";
+    } else if (h.group_size != GROUP_SIZE || h.pe_cols != PE_COLS || h.wgt_channels != WGT_CHANNELS ||
+               h.tile_major != SA_WGT_TILE_MAJOR || h.sparse != SA_WGT_SPARSE) {
+        error = "layout does not match this build (GROUP_SIZE / PE_COLS / WGT_CHANNELS / SA_WGT_TILE_MAJOR / SA_WGT_SPARSE)";
+    } else if (h.group_axis != SA_GROUP_AXIS || h.exp_bits != wgt_fmt::exp_bits ||
+               h.frac_bits != wgt_fmt::frac_bits || h.max_exp != wgt_fmt::max_exp) {
+        error = "weight format does not match this build (SA_GROUP_AXIS / SA_EXP_BITS / SA_WGT_FRAC_BITS / SA_WGT_MAX_EXP)";
+    } else if (h.K < 1 || h.K > K_MAX || h.N < 1) {
+        error = "dimensions out of range";
+    } else if (h.packed_bytes != (uint64_t)wgt_shard_bytes(h.K, h.N) ||
+               h.scale_bytes != (uint64_t)scale_shard_bytes(h.K, h.N)) {
+        error = "shard sizes do not match K and N";
+    } else if (h.data_offset % WEIGHT_FILE_ALIGN != 0 ||
+               scale_offset(h, WGT_CHANNELS - 1) + h.scale_bytes > size_) {
+        error = "truncated file";
+    }
+    if (error) {
+        ::munmap(base_, size_);
+        base_ = nullptr;
+        throw std::runtime_error("MappedWeights: " + path + ": " + error);
+    }
+
+    const uint8_t* bytes = static_cast<const uint8_t*>(base_);
+    for (int c = 0; c < WGT_CHANNELS; c++) {
+        view_.packed[c] = bytes + packed_offset(h, c);
+        view_.scales[c] = bytes + scale_offset(h, c);
+    }
+    view_.packed_bytes = h.packed_bytes;
+    view_.scale_bytes = h.scale_bytes;
+}
+
+MappedWeights::~MappedWeights() {
+    if (base_) ::munmap(base_, size_);
+}
@@ -0,0 +1,67 @@
+#ifndef WEIGHT_FILE_H_
+#define WEIGHT_FILE_H_
+
+#include <cstdint>
+#include <string>
+
+#include "host.h"
+
+// ============================================================================
+// Pre-quantized weight file (.saw)
+//
+// One layer, already in the kernel's HBM layout: for every weight channel c
+// the packed MXINT4 shard followed by its scale shard, byte for byte what
+// SystolicArrayKernel reads from weights_packed_<c> / scales_<c>. Every
+// section starts on a WEIGHT_FILE_ALIGN boundary, so a read-only mmap of the
+// file can be handed to the device as is.
+//
+//   [header][pad] [packed 0][pad] [scales 0][pad] ... [scales C-1][pad]
+// ============================================================================
+const uint32_t WEIGHT_FILE_VERSION = 3;
+const uint64_t WEIGHT_FILE_ALIGN = 4096;
+
+struct WeightFileHeader {
+    char magic[8];              // "SAMXINT4"
+    uint32_t version;
+    uint32_t header_bytes;      // sizeof(WeightFileHeader)
+    int32_t K, N;
+    int32_t group_size;         // GROUP_SIZE
+    int32_t pe_cols;            // PE_COLS (N-tile width)
+    int32_t wgt_channels;       // WGT_CHANNELS (number of shards)
+    int32_t tile_major;         // SA_WGT_TILE_MAJOR (shard layout)
+    int32_t sparse;             // SA_WGT_SPARSE (block index after each shard)
+    int32_t group_axis;         // wgt_fmt: GROUP_ALONG_N / GROUP_ALONG_K
+    int32_t exp_bits;           // wgt_fmt: 2-bit shift or E8M0
+    int32_t frac_bits;          // wgt_fmt: E8M0 exponent range
+    int32_t max_exp;
+    uint64_t packed_bytes;      // per channel
+    uint64_t scale_bytes;       // per channel
+    uint64_t data_offset;       // packed shard of channel 0
+};
+
+// Write the sharded layer (as produced by shard_weights) to path
+void save_weights(const std::string& path, const WeightView& wgt, int K, int N);
+
+// Read-only mapping of a weight file; view() points into the mapping, so it
+// must outlive every use of the view. Throws std::runtime_error on I/O
+// errors or a header that does not match this build.
+class MappedWeights {
+ public:
+    explicit MappedWeights(const std::string& path);
+    ~MappedWeights();
+
+    MappedWeights(const MappedWeights&) = delete;
+    MappedWeights& operator=(const MappedWeights&) = delete;
+
+    int K() const { return header_.K; }
+    int N() const { return header_.N; }
+    const WeightView& view() const { return view_; }
+
+ private:
+    void* base_ = nullptr;
+    size_t size_ = 0;
+    WeightFileHeader header_;
+    WeightView view_;
+};
+
+#endif